@@ -28,7 +28,11 @@
 #include <obs/obs-module.h>
 #include <obs/util/threading.h>
 #include <obs/util/platform.h>
+#include <obs/util/profiler.h>
 #include <obs/graphics/graphics.h>
+#include <obs/graphics/vec2.h>
+#include <obs/graphics/vec4.h>
+#include <obs/graphics/matrix4.h>
 #if !defined(_WIN32) || !_WIN32
 #if LIBOBS_API_VER >= MAKE_SEMANTIC_VERSION(27, 0, 0)
 #include <obs/obs-nix-platform.h>
@@ -50,9 +54,21 @@
 #if !defined(_WIN32) || !_WIN32
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
+#include <X11/extensions/Xfixes.h>
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
 #endif
 
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <math.h>
 #include <assert.h>
 
 OBS_DECLARE_MODULE()
@@ -76,31 +92,484 @@ Atom _NET_CURRENT_DESKTOP = None;
 Atom _NET_NUMBER_OF_DESKTOPS = None;
 Atom _NET_DESKTOP_NAMES = None;
 Atom UTF8_STRING = None;
+Atom _NET_CLIENT_LIST = None;
+Atom _NET_WM_NAME = None;
+#endif
+
+/* Profiler scopes, the profiler tells them apart by pointer. */
+static const char *profile_tick_name = "nvfbc_tick";
+static const char *profile_grab_all_name = "grab_all_sources";
+static const char *profile_enter_graphics_name = "obs_enter_graphics";
+static const char *profile_copy_all_name = "copy_all_sources";
+static const char *profile_capture_thread_name = "nvfbc_capture_thread";
+static const char *profile_session_lock_name = "session_mutex";
+static const char *profile_frame_lock_name = "frame_mutex";
+static const char *profile_texture_lock_name = "texture_mutex";
+static const char *profile_desktop_check_name = "desktop_check";
+static const char *profile_enter_context_name = "enter_nvfbc_context";
+static const char *profile_update_session_name = "update_capture_session";
+static const char *profile_grab_name = "nvFBCToGLGrabFrame";
+static const char *profile_resize_name = "resize_texture";
+static const char *profile_copy_name = "copy_image";
+static const char *profile_mipmaps_name = "update_mipmaps";
+static const char *profile_post_process_name = "post_process";
+static const char *profile_publish_name = "publish_frame";
+static const char *profile_draw_name = "video_render";
+static const char *profile_create_session_name = "create_capture_session";
+static const char *profile_destroy_session_name = "destroy_capture_session";
+#if !defined(_WIN32) || !_WIN32
+static const char *profile_probe_name = "latency_probe_readback";
 #endif
 
+#define TRACE_RING_EVENTS 16384
+#define TRACE_MAX_RINGS 32
+
+/* The sequence is the ring position of the event plus one, stored last. It is 0 while the slot
+	is being written. */
+typedef struct
+{
+	const char *name;
+	uint64_t ts_ns;
+	bool begin;
+	volatile long seq;
+} trace_event_t;
+
+/* Events of one thread. Only the owning thread writes, the head is published after the event. */
+typedef struct trace_ring
+{
+	struct trace_ring *next;
+	const char *thread_name;
+	long id;
+	volatile bool in_use;
+	volatile long head;
+	volatile trace_event_t events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+/* Opt-in tracer, enabled by the OBS_NVFBC_TRACE environment variable at load time. */
+static bool trace_enabled = false;
+static char *trace_prefix = NULL;
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *trace_rings = NULL;
+static long trace_ring_count = 0;
+static long trace_next_id = 0;
+static uint32_t trace_dumps = 0;
+static obs_hotkey_id trace_hotkey = OBS_INVALID_HOTKEY_ID;
+
+/* Called when a thread exits, another thread may take the ring over once all rings are used. */
+static void trace_release_ring(void *p)
+{
+	trace_ring_t *ring = p;
+
+	os_atomic_set_bool(&ring->in_use, false);
+}
+
+static trace_ring_t *trace_get_ring(void)
+{
+	trace_ring_t *ring = pthread_getspecific(trace_key);
+	if (ring != NULL)
+	{
+		return ring;
+	}
+
+	pthread_mutex_lock(&trace_mutex);
+	if (trace_ring_count < TRACE_MAX_RINGS)
+	{
+		ring = bzalloc(sizeof(trace_ring_t));
+		ring->next = trace_rings;
+		trace_rings = ring;
+		trace_ring_count++;
+	}
+	else
+	{
+		for (ring = trace_rings; ring != NULL && os_atomic_load_bool(&ring->in_use); ring = ring->next)
+			;
+	}
+	if (ring != NULL)
+	{
+		ring->id = ++trace_next_id;
+		ring->thread_name = NULL;
+		/* Events of the previous owner must not pass for the new one's. */
+		for (long i = 0; i < TRACE_RING_EVENTS; i++)
+		{
+			os_atomic_set_long(&ring->events[i].seq, 0);
+		}
+		os_atomic_set_long(&ring->head, 0);
+		os_atomic_set_bool(&ring->in_use, true);
+	}
+	pthread_mutex_unlock(&trace_mutex);
+
+	pthread_setspecific(trace_key, ring);
+
+	return ring;
+}
+
+static void trace_add(const char *name, bool begin)
+{
+	trace_ring_t *ring = trace_get_ring();
+	if (ring == NULL)
+	{
+		return;
+	}
+
+	long head = ring->head;
+	volatile trace_event_t *event = &ring->events[head % TRACE_RING_EVENTS];
+	os_atomic_set_long(&event->seq, 0);
+	event->name = name;
+	event->ts_ns = os_gettime_ns();
+	event->begin = begin;
+	os_atomic_set_long(&event->seq, head + 1);
+	os_atomic_set_long(&ring->head, head + 1);
+}
+
+static void trace_set_thread_name(const char *name)
+{
+	if (!trace_enabled)
+	{
+		return;
+	}
+
+	trace_ring_t *ring = trace_get_ring();
+	if (ring != NULL)
+	{
+		ring->thread_name = name;
+	}
+}
+
+/* A pipeline stage for both the OBS profiler and the tracer. */
+static void stage_start(const char *name)
+{
+	profile_start(name);
+	if (trace_enabled)
+	{
+		trace_add(name, true);
+	}
+}
+
+static void stage_end(const char *name)
+{
+	if (trace_enabled)
+	{
+		trace_add(name, false);
+	}
+	profile_end(name);
+}
+
+/* Writes what the rings hold as Chrome trace-event JSON, for chrome://tracing or Perfetto. */
+static void trace_write(void)
+{
+	pthread_mutex_lock(&trace_mutex);
+
+	char path[512];
+	snprintf(path, sizeof(path), "%s-%lld-%u.json", trace_prefix, (long long)time(NULL), trace_dumps++);
+
+	FILE *file = fopen(path, "w");
+	if (file == NULL)
+	{
+		blog(LOG_ERROR, "NvFBC: Could not write trace to %s: %s", path, strerror(errno));
+		goto open_err;
+	}
+
+	trace_event_t *events = bmalloc(sizeof(trace_event_t) * TRACE_RING_EVENTS);
+	uint64_t count = 0;
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	for (trace_ring_t *ring = trace_rings; ring != NULL; ring = ring->next)
+	{
+		long end = os_atomic_load_long(&ring->head);
+		long start = end - TRACE_RING_EVENTS;
+		start = start > 0 ? start : 0;
+
+		/* The thread keeps writing meanwhile. A slot is only taken if it holds the expected event
+			both before and after it was read, otherwise it is being written or was overwritten. */
+		long copied = 0;
+		for (long i = start; i < end; i++)
+		{
+			const volatile trace_event_t *slot = &ring->events[i % TRACE_RING_EVENTS];
+			if (os_atomic_load_long(&slot->seq) != i + 1)
+			{
+				continue;
+			}
+
+			trace_event_t *event = &events[copied];
+			event->name = slot->name;
+			event->ts_ns = slot->ts_ns;
+			event->begin = slot->begin;
+			if (os_atomic_load_long(&slot->seq) == i + 1)
+			{
+				copied++;
+			}
+		}
+
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+			ring != trace_rings ? ",\n" : "", ring->id, ring->thread_name != NULL ? ring->thread_name : "other");
+
+		for (long i = 0; i < copied; i++)
+		{
+			const trace_event_t *event = &events[i];
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%ld}",
+				event->name, event->begin ? "B" : "E", event->ts_ns / 1000.0, ring->id);
+			count++;
+		}
+	}
+	fprintf(file, "\n]}\n");
+
+	bfree(events);
+	fclose(file);
+
+	blog(LOG_INFO, "NvFBC: Wrote %llu trace events to %s", (unsigned long long)count, path);
+
+open_err:;
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+static void trace_hotkey_pressed(void *data, obs_hotkey_id id, obs_hotkey_t *hotkey, bool pressed)
+{
+	if (pressed)
+	{
+		trace_write();
+	}
+}
+
+static void trace_start(const char *prefix)
+{
+	int error = pthread_key_create(&trace_key, trace_release_ring);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Thread key creation error: %s", strerror(error));
+		return;
+	}
+
+	trace_prefix = bstrdup(prefix);
+	trace_hotkey = obs_hotkey_register_frontend("nvfbc_write_trace", "Write NvFBC Trace", trace_hotkey_pressed, NULL);
+	trace_enabled = true;
+
+	blog(LOG_INFO, "NvFBC: Tracing enabled, writing to %s-*.json on exit or hotkey", trace_prefix);
+}
+
+static void trace_stop(void)
+{
+	if (!trace_enabled)
+	{
+		return;
+	}
+
+	trace_write();
+	trace_enabled = false;
+
+	if (trace_hotkey != OBS_INVALID_HOTKEY_ID)
+	{
+		obs_hotkey_unregister(trace_hotkey);
+		trace_hotkey = OBS_INVALID_HOTKEY_ID;
+	}
+
+	pthread_key_delete(trace_key);
+	while (trace_rings != NULL)
+	{
+		trace_ring_t *ring = trace_rings;
+		trace_rings = ring->next;
+		bfree(ring);
+	}
+	trace_ring_count = 0;
+	trace_next_id = 0;
+
+	bfree(trace_prefix);
+	trace_prefix = NULL;
+}
+
+static const char post_effect_string[] =
+	"uniform float4x4 ViewProj;\n"
+	"uniform texture2d image;\n"
+	"uniform float4 crop;\n"
+	"uniform float2 texel;\n"
+	"uniform int mask_count;\n"
+	"uniform float4 mask0;\n"
+	"uniform float4 mask1;\n"
+	"uniform float4 mask2;\n"
+	"uniform float4 mask3;\n"
+	"uniform float4 mask_blur;\n"
+	"uniform float4x4 color_matrix;\n"
+	"\n"
+	"sampler_state def_sampler {\n"
+	"	Filter = Linear;\n"
+	"	AddressU = Clamp;\n"
+	"	AddressV = Clamp;\n"
+	"};\n"
+	"\n"
+	"struct VertInOut {\n"
+	"	float4 pos : POSITION;\n"
+	"	float2 uv : TEXCOORD0;\n"
+	"};\n"
+	"\n"
+	"VertInOut VSDefault(VertInOut vert_in)\n"
+	"{\n"
+	"	VertInOut vert_out;\n"
+	"	vert_out.pos = mul(float4(vert_in.pos.xyz, 1.0), ViewProj);\n"
+	"	vert_out.uv = vert_in.uv;\n"
+	"	return vert_out;\n"
+	"}\n"
+	"\n"
+	"float4 Blur(float2 uv, float radius)\n"
+	"{\n"
+	"	float4 sum = float4(0.0, 0.0, 0.0, 0.0);\n"
+	"	for (int y = -2; y <= 2; y++) {\n"
+	"		for (int x = -2; x <= 2; x++) {\n"
+	"			sum += image.Sample(def_sampler, uv + float2(x, y) * texel * (radius / 2.0));\n"
+	"		}\n"
+	"	}\n"
+	"	return sum / 25.0;\n"
+	"}\n"
+	"\n"
+	"float4 Mask(float4 color, float2 out_uv, float2 uv, float4 rect, float radius)\n"
+	"{\n"
+	"	if (out_uv.x >= rect.x && out_uv.y >= rect.y && out_uv.x < rect.z && out_uv.y < rect.w)\n"
+	"		return radius > 0.0 ? Blur(uv, radius) : float4(0.0, 0.0, 0.0, 1.0);\n"
+	"	return color;\n"
+	"}\n"
+	"\n"
+	"float4 PSPostProcess(VertInOut vert_in) : TARGET\n"
+	"{\n"
+	"	float2 uv = crop.xy + vert_in.uv * crop.zw;\n"
+	"	float4 color = image.Sample(def_sampler, uv);\n"
+	"	if (mask_count > 0)\n"
+	"		color = Mask(color, vert_in.uv, uv, mask0, mask_blur.x);\n"
+	"	if (mask_count > 1)\n"
+	"		color = Mask(color, vert_in.uv, uv, mask1, mask_blur.y);\n"
+	"	if (mask_count > 2)\n"
+	"		color = Mask(color, vert_in.uv, uv, mask2, mask_blur.z);\n"
+	"	if (mask_count > 3)\n"
+	"		color = Mask(color, vert_in.uv, uv, mask3, mask_blur.w);\n"
+	"	return float4(mul(float4(color.rgb, 1.0), color_matrix).rgb, 1.0);\n"
+	"}\n"
+	"\n"
+	"technique Draw\n"
+	"{\n"
+	"	pass\n"
+	"	{\n"
+	"		vertex_shader = VSDefault(vert_in);\n"
+	"		pixel_shader = PSPostProcess(vert_in);\n"
+	"	}\n"
+	"}\n";
+
+static gs_effect_t *post_effect = NULL;
+/* GL_MAX_TEXTURE_SIZE of the OBS context, a stitched capture must fit into one texture. */
+static uint32_t max_texture_size = 0;
+
 static NVFBC_API_FUNCTION_LIST nvFBC = {
 	.dwVersion = NVFBC_VERSION};
 
+enum
+{
+	CAPTURE_POLICY_ALWAYS,
+	CAPTURE_POLICY_REDUCED,
+	CAPTURE_POLICY_PROGRAM,
+};
+
+#if !defined(_WIN32) || !_WIN32
+enum
+{
+	THREAD_PRIORITY_NORMAL,
+	THREAD_PRIORITY_HIGH,
+	THREAD_PRIORITY_FIFO,
+	THREAD_PRIORITY_RR,
+};
+
+#define THREAD_HIGH_NICE -10
+#define THREAD_RT_PRIORITY 10
+#endif
+
+enum
+{
+	CAPTURE_PAUSED,
+	CAPTURE_REDUCED,
+	CAPTURE_FULL,
+};
+
 typedef struct
 {
 	obs_source_t *source;
+	bool showing;
+	bool active;
+	uint32_t tick_count;
+	uint64_t create_ns;
+	bool has_first_frame;
 } data_obs_t;
 
+#define POST_MAX_MASKS 4
+
+/* A mask in output pixels, blurred with the given radius or black if it is 0. */
+typedef struct
+{
+	uint32_t x, y, w, h;
+	float blur;
+} post_mask_t;
+
+#define SCREEN_STITCHED -2
+#define SCREEN_WINDOW -3
+#define SCREEN_CURSOR -4
+#define STITCH_LAYOUT_LEN 256
+
 typedef struct
 {
 	int screen;
+	char stitch_layout[STITCH_LAYOUT_LEN];
 	bool show_cursor;
 	int fps;
 	bool push_model;
+	bool auto_model;
 	bool direct_capture;
+	bool adaptive_resolution;
+	bool mipmaps;
+	bool phase_lock;
+	bool low_latency;
+	bool threaded;
+	int capture_policy;
+	int reduced_divider;
+	int crop_left, crop_top, crop_right, crop_bottom;
+	uint32_t mask_count;
+	post_mask_t masks[POST_MAX_MASKS];
+	bool has_color_matrix;
+	float color_matrix[12];
 #if !defined(_WIN32) || !_WIN32
 	long desktop;
+	long window;
+	int zoom_width, zoom_height;
+	bool cursor_overlay;
+	bool latency_probe;
+	int thread_priority;
+	bool has_affinity;
+	cpu_set_t affinity;
+	int timer_slack_us;
 #endif
 } data_settings_t;
 
+/* An output's box on the X screen and where it goes in the stitched texture. */
+typedef struct
+{
+	NVFBC_BOX src;
+	uint32_t x, y;
+} stitch_tile_t;
+
+/* What copying and drawing a frame needs to know about the session it was grabbed with. Frames
+	carry a copy, so the graphics thread never reads the session while a capture thread changes it. */
+typedef struct
+{
+	NVFBC_BOX tracked_box;
+	NVFBC_BOX view;
+	long scale_step;
+	uint32_t stitch_count;
+	stitch_tile_t stitch_tiles[NVFBC_OUTPUT_MAX];
+	uint32_t stitch_width, stitch_height;
+	GLenum tex_target;
+} frame_layout_t;
+
 typedef struct
 {
 	pthread_mutex_t session_mutex;
+	/* Held instead of the session mutex while the capture thread waits in a grab with the NvFBC
+		context bound. Anybody else binding the context takes it after the session mutex. */
+	pthread_mutex_t grab_mutex;
+	uint32_t session_id;
 	NVFBC_SESSION_HANDLE nvfbc_session;
 #if _WIN32
 	HGLRC nvfbc_ctx;
@@ -108,13 +577,32 @@ typedef struct
 	GLXContext nvfbc_ctx;
 #endif
 	bool has_capture_session;
+	bool needs_rebuild;
+	/* The model the session is created with, the setting or what calibration chose. */
+	bool push_model;
 	NVFBC_TOGL_SETUP_PARAMS togl_setup_params;
+	NVFBC_BOX tracked_box;
+	long scale_step;
+	bool force_refresh;
+	uint32_t stitch_count;
+	stitch_tile_t stitch_tiles[NVFBC_OUTPUT_MAX];
+	uint32_t stitch_width, stitch_height;
+	NVFBC_BOX follow_box;
+	uint32_t follow_w, follow_h;
+	NVFBC_BOX capture_box;
+	NVFBC_BOX view;
+	uint64_t rebuild_ns;
 } data_nvfbc_t;
 
 typedef struct
 {
 	pthread_mutex_t texture_mutex;
 	uint32_t width, height;
+	uint32_t display_width, display_height;
+	NVFBC_BOX view;
+	frame_layout_t layout;
+	bool has_mipmaps;
+	uint64_t small_draw_ns;
 	gs_texture_t *texture;
 } data_texture_t;
 
@@ -124,9 +612,308 @@ typedef struct
 	Display *dpy;
 	int visible_transition;
 } data_x11_t;
+
+/* The cursor is tracked on a private connection so XFixes calls never interfere with OBS's display. */
+typedef struct
+{
+	Display *dpy;
+	gs_texture_t *texture;
+	unsigned long serial;
+	uint32_t width, height;
+	int x, y;
+	bool visible;
+} data_cursor_t;
+
+/* The followed window or pointer is watched on a private connection as well. */
+typedef struct
+{
+	Display *dpy;
+	Window window;
+	Window lost;
+	bool changed;
+} data_window_t;
 #endif
 
+#define CLOCK_SYNC_WINDOW_NS 1000000000ULL
+#define CLOCK_SYNC_WINDOWS 16
+#define CLOCK_SYNC_MAX_DRIFT 0.0005
+#define LATENCY_HIST_BUCKETS 64
+#define SCHED_LEAD_NS 2000000LL
+#define SCHED_TOLERANCE_NS 1000000LL
+#define SCHED_LOCKABLE_ERROR_NS 50000LL
+#define SCHED_REARM_MARGIN_NS 2000000ULL
+#define SCHED_COOLDOWN_NS 5000000000ULL
+#define SCHED_REPORT_INTERVAL_NS 60000000000ULL
+#define SCHED_WINDOW_FRAMES 60
+
+/* Maps NvFBC's ulTimestampUs onto os_gettime_ns(). A frame can never be grabbed
+	before it was rendered, so the smallest offset of a window is the best estimate for it.
+	A line through the minima of the last windows follows the drift between both clocks. */
+typedef struct
+{
+	int64_t window_min_ns;
+	uint64_t window_min_local_ns;
+	uint64_t window_start_ns;
+	int64_t min_offset_ns[CLOCK_SYNC_WINDOWS];
+	uint64_t min_local_ns[CLOCK_SYNC_WINDOWS];
+	uint32_t min_count, min_next;
+	uint64_t ref_local_ns;
+	int64_t offset_ns;
+	double drift;
+	bool valid;
+} clock_sync_t;
+
+/* 1 ms buckets, the last one collects everything above. */
+typedef struct
+{
+	uint32_t buckets[LATENCY_HIST_BUCKETS];
+	uint32_t count;
+	uint64_t max_ns;
+} latency_hist_t;
+
+typedef struct
+{
+	uint64_t interval_ns;
+	uint64_t last_tick_ns;
+	clock_sync_t clock;
+	latency_hist_t hist;
+	uint64_t report_ns;
+	int64_t phase_err_sum_ns;
+	uint32_t phase_err_count;
+	int64_t arm_delay_ns;
+	bool settling;
+	uint64_t cooldown_ns;
+	/* Phase errors NvFBC's whole-millisecond sampling timer makes anyway, re-arming can not fix them. */
+	int64_t jitter_ns;
+	uint64_t rearm_ns;
+	uint32_t rearm_count;
+	uint32_t rearm_skipped;
+	pthread_t thread;
+	bool has_thread;
+	os_event_t *event;
+	volatile bool stop;
+} data_sched_t;
+
+#define CAPTURE_DEADLINE_MARGIN_NS 1000000ULL
+#define CAPTURE_IDLE_WAIT_MS 100
+#define BENCH_STEP_NS 5000000000ULL
+#define BENCH_MAX_SOURCES 4
+
+/* Per-source share of a benchmark step. */
+typedef struct
+{
+	char name[64];
+	uint64_t frames;
+	uint64_t grabs;
+	uint64_t grab_sum_ns;
+	uint64_t grab_max_ns;
+} bench_source_t;
+
+/* Module-wide capture timing, to compare render-thread and threaded capture across sources. The
+	run captures with the first source only, then adds one source per step. */
+typedef struct
+{
+	/* End of the current step, 0 while no benchmark runs. */
+	uint64_t end_ns;
+	uint32_t source_count;
+	uint32_t step_sources;
+	uint64_t frames;
+	uint64_t busy_sum_ns;
+	uint64_t busy_max_ns;
+	bench_source_t sources[BENCH_MAX_SOURCES];
+} capture_bench_t;
+
+static pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+static capture_bench_t bench;
+
+typedef struct
+{
+	pthread_t thread;
+	bool has_thread;
+	volatile bool stop;
+	os_event_t *wake;
+	pthread_mutex_t frame_mutex;
+	bool ready;
+	GLuint texture;
+	NVFBC_FRAME_GRAB_INFO info;
+	frame_layout_t layout;
+	uint64_t grab_ns;
+	uint64_t frame_ns;
+} data_capture_t;
+
+/* State of one source within the per-frame grab pass of the coordinator. */
+typedef struct data_batch
+{
+	struct data *next;
+	obs_weak_source_t *weak_source;
+	/* The sources with work in the current pass, each holding a reference. */
+	struct data *pending_next;
+	bool pending;
+	bool grabbed;
+	GLuint texture;
+	NVFBC_FRAME_GRAB_INFO info;
+	uint64_t grab_ns;
+	uint64_t frame_ns;
+	/* Slot in the running benchmark, -1 if the source is left out. Guarded by the bench mutex. */
+	int bench_slot;
+} data_batch_t;
+
+#define CALIB_WINDOW_NS 3000000000ULL
+#define CALIB_MIN_FRAMES 30
+
+enum
+{
+	CALIB_DONE,
+	CALIB_PULL,
+	CALIB_PUSH,
+};
+
+/* Both models are judged per grab, which happens once per OBS frame or per capture thread loop. */
+typedef struct
+{
+	uint32_t grabs;
+	uint32_t frames;
+	uint64_t missed;
+	uint64_t age_sum_ns;
+} model_stats_t;
+
+typedef struct
+{
+	int state;
+	uint64_t state_end_ns;
+	uint32_t width, height;
+	model_stats_t stats[2];
+} data_calib_t;
+
+#define DIRECT_WINDOW_FRAMES 120
+#define DIRECT_MAX_SWITCHES 6
+
+typedef struct
+{
+	uint32_t frames, direct, post_processed, switches;
+} direct_counters_t;
+
+typedef struct
+{
+	direct_counters_t total;
+	direct_counters_t window;
+	bool last_direct;
+	bool fallen_back;
+} data_direct_t;
+
+#define SCALE_WINDOW_FRAMES 60
+#define SCALE_BUDGET_DIVIDER 8
+#define SCALE_DOWN_WINDOWS 2
+#define SCALE_UP_WINDOWS 10
+
+static const uint32_t scale_percents[] = {100, 75, 50, 33};
+
+/* Copy time controller, only the target step is touched outside the graphics thread. */
+typedef struct
+{
+	volatile long target_step;
+	uint32_t frames;
+	uint64_t copy_sum_ns;
+	uint32_t over_windows, under_windows;
+} data_scale_t;
+
+typedef struct
+{
+	gs_texrender_t *texrender;
+	uint32_t width, height;
+	bool ready;
+} data_post_t;
+
+#define TELEMETRY_HIST_BUCKETS 100
+
+/* Quarter-octave buckets of microseconds, exact below 4 us. */
+typedef struct
+{
+	int64_t buckets[TELEMETRY_HIST_BUCKETS];
+} telemetry_hist_t;
+
+/* Counters since the source was created, polled through the proc handlers. Grabs move between the
+	graphics thread and the capture thread, so every access is a 64-bit atomic. */
+typedef struct
+{
+	int64_t grabs;
+	int64_t new_frames;
+	int64_t missed_frames;
+	int64_t duplicate_grabs;
+	int64_t current_frame;
+	int64_t copies;
+	int64_t copy_bytes;
+	telemetry_hist_t grab_hist;
+	telemetry_hist_t copy_hist;
+	telemetry_hist_t post_hist;
+	telemetry_hist_t draw_hist;
+	telemetry_hist_t gpu_copy_hist;
+	telemetry_hist_t gpu_post_hist;
+	telemetry_hist_t gpu_draw_hist;
+} data_telemetry_t;
+
+#define GPU_TIMER_QUERIES 8
+
+/* GL_TIME_ELAPSED queries, read back once the GPU is done with them so nothing ever waits.
+	Graphics thread only. */
+typedef struct
+{
+	GLuint queries[GPU_TIMER_QUERIES];
+	uint32_t next, pending;
+	bool running;
+	/* Results read back since the last gpu_timer_take(). */
+	uint32_t resolved;
+	uint64_t resolved_sum_ns;
+} gpu_timer_t;
+
+typedef struct
+{
+	gpu_timer_t copy;
+	gpu_timer_t post;
+	gpu_timer_t draw;
+} data_gpu_t;
+
+#if !defined(_WIN32) || !_WIN32
+#define PROBE_MARKER_SIZE 32
+#define PROBE_SAMPLE_OFFSET 8
+#define PROBE_INTERVAL_MS 200
+#define PROBE_JITTER_MS 100
+#define PROBE_REPORT_INTERVAL_NS 10000000000ULL
+#define PROBE_READBACKS 4
+
+/* One sampled pixel on its way back from the GPU. */
+typedef struct
+{
+	GLuint buffer;
+	GLsync fence;
+	uint64_t grab_ns;
+	uint64_t render_ns;
+} probe_readback_t;
+
+/* Glass-to-capture measurement. A thread flips a small window in the top-left corner of the
+	captured region between black and white, every new frame is sampled at that spot. The marker
+	state is guarded by the mutex, texture and readbacks belong to the graphics thread. */
 typedef struct
+{
+	pthread_t thread;
+	bool has_thread;
+	os_event_t *stop_event;
+	pthread_mutex_t mutex;
+	volatile long x, y;
+	bool white;
+	bool seen;
+	uint64_t marker_ns;
+	uint32_t markers, detected;
+	latency_hist_t grab_hist;
+	latency_hist_t render_hist;
+	uint64_t report_ns;
+	GLuint texture;
+	probe_readback_t readbacks[PROBE_READBACKS];
+	uint32_t readback_next, readback_pending;
+} data_probe_t;
+#endif
+
+typedef struct data
 {
 	data_obs_t obs;
 	data_settings_t settings;
@@ -134,9 +921,52 @@ typedef struct
 	data_texture_t tex;
 #if !defined(_WIN32) || !_WIN32
 	data_x11_t x11;
+	data_cursor_t cursor;
+#endif
+	data_sched_t sched;
+	data_capture_t capture;
+	data_calib_t calib;
+	data_direct_t direct;
+	data_batch_t batch;
+	data_scale_t scale;
+	data_post_t post;
+	data_telemetry_t telemetry;
+	data_gpu_t gpu;
+#if !defined(_WIN32) || !_WIN32
+	data_window_t window;
+	data_probe_t probe;
 #endif
 } data_t;
 
+/* All NvFBC sources, so one of them can grab for everybody once per OBS frame. */
+static pthread_mutex_t coordinator_mutex = PTHREAD_MUTEX_INITIALIZER;
+static data_t *coordinator_sources = NULL;
+static uint64_t coordinator_tick_ns = 0;
+
+#define BACKPRESSURE_WINDOW_NS 1000000000ULL
+#define BACKPRESSURE_LAG_THRESHOLD 2
+#define BACKPRESSURE_CALM_WINDOWS 3
+
+enum
+{
+	BACKPRESSURE_NONE,
+	BACKPRESSURE_SHED_IDLE,
+	BACKPRESSURE_HALF_RATE,
+};
+
+/* Sheds capture load while OBS is lagging frames. Guarded by the coordinator mutex. */
+typedef struct
+{
+	int level;
+	uint64_t window_start_ns;
+	uint32_t window_lagged;
+	uint32_t calm_windows;
+	uint64_t busy_avg_ns;
+	uint32_t frame_count;
+} backpressure_t;
+
+static backpressure_t backpressure;
+
 static const char *get_name(void *type_data)
 {
 	return "NvFBC Source";
@@ -287,806 +1117,4901 @@ static bool get_nvfbc_status(NVFBC_SESSION_HANDLE session, NVFBC_GET_STATUS_PARA
 	return ret2;
 }
 
-static bool create_capture_session(data_nvfbc_t *data_nvfbc, data_settings_t *settings)
+static void bench_report_step(void)
 {
-	if (data_nvfbc->has_capture_session)
+	double seconds = BENCH_STEP_NS / 1000000000.0;
+	uint64_t frames = 0, grab_sum_ns = 0;
+	for (uint32_t i = 0; i < bench.step_sources; ++i)
 	{
-		return false;
+		frames += bench.sources[i].frames;
+		grab_sum_ns += bench.sources[i].grab_sum_ns;
 	}
 
-	NVFBC_CREATE_CAPTURE_SESSION_PARAMS cap_params = {
-		.dwVersion = NVFBC_CREATE_CAPTURE_SESSION_PARAMS_VER,
-		.eCaptureType = NVFBC_CAPTURE_TO_GL,
-		.eTrackingType = settings->screen == -1 ? NVFBC_TRACKING_SCREEN : NVFBC_TRACKING_OUTPUT,
-		.dwOutputId = settings->screen,
-		.bWithCursor = settings->show_cursor ? NVFBC_TRUE : NVFBC_FALSE,
-		.bDisableAutoModesetRecovery = NVFBC_FALSE,
-		.bRoundFrameSize = NVFBC_TRUE,
-		.dwSamplingRateMs = 1000.0 / settings->fps + 0.5,
-		.bPushModel = settings->push_model ? NVFBC_TRUE : NVFBC_FALSE,
-		.bAllowDirectCapture = settings->direct_capture ? NVFBC_TRUE : NVFBC_FALSE,
-	};
+	blog(LOG_INFO, "NvFBC benchmark: %u of %u sources, %.1f frames/s in total, graphics thread busy %.3f ms/frame (max %.3f ms), "
+		       "%.3f ms grab time per frame",
+		bench.step_sources, bench.source_count, frames / seconds,
+		bench.frames > 0 ? bench.busy_sum_ns / 1000000.0 / bench.frames : 0.0, bench.busy_max_ns / 1000000.0,
+		bench.frames > 0 ? grab_sum_ns / 1000000.0 / bench.frames : 0.0);
 
-	NVFBCSTATUS ret = nvFBC.nvFBCCreateCaptureSession(data_nvfbc->nvfbc_session, &cap_params);
-	if (ret != NVFBC_SUCCESS)
+	for (uint32_t i = 0; i < bench.step_sources; ++i)
 	{
-		blog(LOG_ERROR, "%s", nvFBC.nvFBCGetLastErrorStr(data_nvfbc->nvfbc_session));
-		return false;
+		const bench_source_t *source = &bench.sources[i];
+		if (source->grabs > 0)
+		{
+			blog(LOG_INFO, "NvFBC benchmark:   '%s': %.1f frames/s, %llu non-blocking grabs at %.3f ms (max %.3f ms)",
+				source->name, source->frames / seconds,
+				(unsigned long long)source->grabs, source->grab_sum_ns / 1000000.0 / source->grabs, source->grab_max_ns / 1000000.0);
+		}
+		else
+		{
+			blog(LOG_INFO, "NvFBC benchmark:   '%s': %.1f frames/s, no grabs on the graphics thread",
+				source->name, source->frames / seconds);
+		}
 	}
+}
 
-	data_nvfbc->togl_setup_params = (NVFBC_TOGL_SETUP_PARAMS){
-		.dwVersion = NVFBC_TOGL_SETUP_PARAMS_VER,
-		.eBufferFormat = NVFBC_BUFFER_FORMAT_RGBA,
-		.bWithDiffMap = NVFBC_FALSE,
-		.dwDiffMapScalingFactor = 1};
+/* Must be called with the bench mutex held. */
+static void bench_next_step(uint64_t now_ns)
+{
+	bench_report_step();
 
-	ret = nvFBC.nvFBCToGLSetUp(data_nvfbc->nvfbc_session, &data_nvfbc->togl_setup_params);
-	if (ret != NVFBC_SUCCESS)
+	if (bench.step_sources >= bench.source_count)
 	{
-		blog(LOG_ERROR, "%s", nvFBC.nvFBCGetLastErrorStr(data_nvfbc->nvfbc_session));
-		goto setup_error;
+		blog(LOG_INFO, "NvFBC benchmark: done");
+		bench.end_ns = 0;
+		return;
 	}
 
-	data_nvfbc->has_capture_session = true;
+	++bench.step_sources;
+	bench.end_ns = now_ns + BENCH_STEP_NS;
+	bench.frames = 0;
+	bench.busy_sum_ns = 0;
+	bench.busy_max_ns = 0;
+	for (uint32_t i = 0; i < BENCH_MAX_SOURCES; ++i)
+	{
+		bench.sources[i].frames = 0;
+		bench.sources[i].grabs = 0;
+		bench.sources[i].grab_sum_ns = 0;
+		bench.sources[i].grab_max_ns = 0;
+	}
+}
 
-	return true;
+/* Takes the coordinator mutex, so it must not be called with the bench mutex held. */
+static void bench_start(void)
+{
+	pthread_mutex_lock(&coordinator_mutex);
+	pthread_mutex_lock(&bench_mutex);
 
-setup_error:;
-	NVFBC_DESTROY_CAPTURE_SESSION_PARAMS destroy_cap_params = {
-		.dwVersion = NVFBC_DESTROY_CAPTURE_SESSION_PARAMS_VER,
-	};
+	if (bench.end_ns != 0)
+	{
+		blog(LOG_INFO, "NvFBC benchmark: already running");
+		goto running;
+	}
 
-	ret = nvFBC.nvFBCDestroyCaptureSession(data_nvfbc->nvfbc_session, &destroy_cap_params);
-	if (ret != NVFBC_SUCCESS)
+	bench = (capture_bench_t){0};
+	for (data_t *data = coordinator_sources; data != NULL; data = data->batch.next)
 	{
-		blog(LOG_WARNING, "%s", nvFBC.nvFBCGetLastErrorStr(data_nvfbc->nvfbc_session));
+		data->batch.bench_slot = -1;
+		if (bench.source_count < BENCH_MAX_SOURCES)
+		{
+			data->batch.bench_slot = bench.source_count;
+			snprintf(bench.sources[bench.source_count].name, sizeof(bench.sources[0].name), "%s",
+				obs_source_get_name(data->obs.source));
+			++bench.source_count;
+		}
 	}
 
-	return false;
+	if (bench.source_count == 0)
+	{
+		blog(LOG_INFO, "NvFBC benchmark: no NvFBC sources");
+		goto running;
+	}
+
+	blog(LOG_INFO, "NvFBC benchmark: measuring 1 to %u sources for %.0f seconds each, other NvFBC sources are paused meanwhile",
+		bench.source_count, BENCH_STEP_NS / 1000000000.0);
+	bench.step_sources = 1;
+	bench.end_ns = os_gettime_ns() + BENCH_STEP_NS;
+
+running:;
+	pthread_mutex_unlock(&bench_mutex);
+	pthread_mutex_unlock(&coordinator_mutex);
 }
 
-static void destroy_capture_session(data_nvfbc_t *data_nvfbc)
+/* Whether the running benchmark leaves the source out of the current step. */
+static bool bench_pauses(const data_t *data)
 {
-	if (!data_nvfbc->has_capture_session)
+	if (bench.end_ns == 0)
 	{
-		return;
+		return false;
 	}
 
-	NVFBC_DESTROY_CAPTURE_SESSION_PARAMS destroy_cap_params = {
-		.dwVersion = NVFBC_DESTROY_CAPTURE_SESSION_PARAMS_VER};
+	pthread_mutex_lock(&bench_mutex);
+	bool paused = bench.end_ns != 0 && (data->batch.bench_slot < 0 || (uint32_t)data->batch.bench_slot >= bench.step_sources);
+	pthread_mutex_unlock(&bench_mutex);
+	return paused;
+}
 
-	NVFBCSTATUS ret = nvFBC.nvFBCDestroyCaptureSession(data_nvfbc->nvfbc_session, &destroy_cap_params);
-	if (ret != NVFBC_SUCCESS)
+/* Time the graphics thread spent capturing in one OBS frame. */
+static void bench_add_frame(uint64_t busy_ns, uint32_t sources)
+{
+	if (bench.end_ns == 0)
 	{
-		blog(LOG_WARNING, "%s", nvFBC.nvFBCGetLastErrorStr(data_nvfbc->nvfbc_session));
+		return;
 	}
 
-	data_nvfbc->has_capture_session = false;
+	pthread_mutex_lock(&bench_mutex);
+	if (bench.end_ns != 0)
+	{
+		if (sources > 0)
+		{
+			++bench.frames;
+			bench.busy_sum_ns += busy_ns;
+			if (busy_ns > bench.busy_max_ns)
+			{
+				bench.busy_max_ns = busy_ns;
+			}
+		}
+
+		uint64_t now_ns = os_gettime_ns();
+		if (now_ns >= bench.end_ns)
+		{
+			bench_next_step(now_ns);
+		}
+	}
+	pthread_mutex_unlock(&bench_mutex);
 }
 
-static bool switch_to_nvfbc_context(data_nvfbc_t *data_nvfbc)
+/* Time one non-blocking nvFBCToGLGrabFrame() call took. Blocking grabs would only measure the wait for a frame. */
+static void bench_add_grab(const data_t *data, uint64_t grab_ns)
 {
-	if (data_nvfbc->nvfbc_session == -1)
+	if (bench.end_ns == 0)
 	{
-		return false;
+		return;
 	}
 
-	obs_leave_graphics();
-
-	if (!enter_nvfbc_context(data_nvfbc))
+	pthread_mutex_lock(&bench_mutex);
+	if (bench.end_ns != 0 && data->batch.bench_slot >= 0)
 	{
-		obs_enter_graphics();
-		return false;
+		bench_source_t *source = &bench.sources[data->batch.bench_slot];
+		++source->grabs;
+		source->grab_sum_ns += grab_ns;
+		if (grab_ns > source->grab_max_ns)
+		{
+			source->grab_max_ns = grab_ns;
+		}
 	}
-
-	return true;
+	pthread_mutex_unlock(&bench_mutex);
 }
 
-static void switch_to_obs_context(data_nvfbc_t *data_nvfbc)
+/* A new frame of the source reached its OBS texture. */
+static void bench_add_source_frame(const data_t *data)
 {
-	leave_nvfbc_context(data_nvfbc);
+	if (bench.end_ns == 0)
+	{
+		return;
+	}
 
-	obs_enter_graphics();
+	pthread_mutex_lock(&bench_mutex);
+	if (bench.end_ns != 0 && data->batch.bench_slot >= 0)
+	{
+		++bench.sources[data->batch.bench_slot].frames;
+	}
+	pthread_mutex_unlock(&bench_mutex);
 }
 
-static bool capture_frame(data_nvfbc_t *data_nvfbc, GLuint *out_texture, NVFBC_FRAME_GRAB_INFO *out_info)
+static uint64_t get_obs_frame_interval_ns(void)
 {
-	if (!data_nvfbc->has_capture_session)
+	struct obs_video_info ovi;
+	if (!obs_get_video_info(&ovi) || ovi.fps_num == 0)
 	{
-		return false;
+		return 0;
 	}
 
-	NVFBC_TOGL_GRAB_FRAME_PARAMS grab_params = {
-		.dwVersion = NVFBC_TOGL_GRAB_FRAME_PARAMS_VER,
-		.dwFlags = NVFBC_TOGL_GRAB_FLAGS_NOWAIT,
-		.pFrameGrabInfo = out_info,
-		.dwTimeoutMs = 0};
+	return 1000000000ULL * ovi.fps_den / ovi.fps_num;
+}
 
-	NVFBCSTATUS ret = nvFBC.nvFBCToGLGrabFrame(data_nvfbc->nvfbc_session, &grab_params);
-	if (ret != NVFBC_SUCCESS)
+/* Refuses tiles that would grow the stitched texture beyond the GL size limit. */
+static bool add_stitch_tile(data_nvfbc_t *data_nvfbc, NVFBC_BOX src, uint32_t x, uint32_t y)
+{
+	if (x > max_texture_size || src.w > max_texture_size - x || y > max_texture_size || src.h > max_texture_size - y)
 	{
-		blog(LOG_ERROR, "%s", nvFBC.nvFBCGetLastErrorStr(data_nvfbc->nvfbc_session));
 		return false;
 	}
 
-	*out_texture = data_nvfbc->togl_setup_params.dwTextures[grab_params.dwTextureIndex];
+	stitch_tile_t *tile = &data_nvfbc->stitch_tiles[data_nvfbc->stitch_count++];
+	tile->src = src;
+	tile->x = x;
+	tile->y = y;
 
+	if (x + src.w > data_nvfbc->stitch_width)
+	{
+		data_nvfbc->stitch_width = x + src.w;
+	}
+	if (y + src.h > data_nvfbc->stitch_height)
+	{
+		data_nvfbc->stitch_height = y + src.h;
+	}
 	return true;
 }
 
-static bool need_texture_resize(data_texture_t *data_texture, uint32_t width, uint32_t height)
+/* Packs the chosen outputs into one texture. The layout lists "output:x,y" entries separated by
+	semicolons, an empty layout puts all outputs next to each other. Outputs that do not fit into
+	GL_MAX_TEXTURE_SIZE are left out. */
+static void update_stitch_layout(data_nvfbc_t *data_nvfbc, const data_settings_t *settings, const NVFBC_GET_STATUS_PARAMS *status_params)
 {
-	return data_texture->texture == NULL || width != data_texture->width || height != data_texture->height;
-}
+	data_nvfbc->stitch_count = 0;
+	data_nvfbc->stitch_width = 0;
+	data_nvfbc->stitch_height = 0;
 
-static bool resize_texture(data_texture_t *data_texture, uint32_t width, uint32_t height)
-{
-	if (data_texture->texture != NULL)
+	const char *p = settings->stitch_layout;
+	if (*p == '\0')
 	{
-		gs_texture_destroy(data_texture->texture);
+		for (uint32_t i = 0; i < status_params->dwOutputNum; i++)
+		{
+			if (!add_stitch_tile(data_nvfbc, status_params->outputs[i].trackedBox, data_nvfbc->stitch_width, 0))
+			{
+				blog(LOG_WARNING, "NvFBC: Output %s does not fit into the maximum texture size of %u, leaving it out",
+					status_params->outputs[i].name, max_texture_size);
+			}
+		}
+		goto check_count;
 	}
 
-	data_texture->texture = gs_texture_create(width, height, GS_RGBA, 1, NULL, GS_DYNAMIC);
-	if (data_texture->texture == NULL)
+	while (*p != '\0' && data_nvfbc->stitch_count < NVFBC_OUTPUT_MAX)
 	{
-		return false;
-	}
+		while (*p == ' ')
+		{
+			p++;
+		}
 
-	/* HACK: OBS's graphics api doesn't support creating a texture with internal format GL_RGBA8,
-		which is required by *CopyImageSubDataNV because the NvFBC texture has that format. */
-	GLuint new_tex;
-	glGenTextures(1, &new_tex);
-	glBindTexture(GL_TEXTURE_2D, new_tex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	GLuint old_tex = *(GLuint *)gs_texture_get_obj(data_texture->texture);
-	*(GLuint *)gs_texture_get_obj(data_texture->texture) = new_tex;
-	glDeleteTextures(1, &old_tex);
+		const char *end = strchr(p, ';');
+		size_t len = end != NULL ? (size_t)(end - p) : strlen(p);
+		const char *colon = memchr(p, ':', len);
+		unsigned int x, y;
+		bool found = false;
+		bool fits = true;
 
-	data_texture->width = width;
-	data_texture->height = height;
+		if (colon != NULL && sscanf(colon + 1, "%u,%u", &x, &y) == 2)
+		{
+			for (uint32_t i = 0; i < status_params->dwOutputNum && !found; i++)
+			{
+				const char *name = status_params->outputs[i].name;
+				if (strlen(name) == (size_t)(colon - p) && strncmp(name, p, colon - p) == 0)
+				{
+					fits = add_stitch_tile(data_nvfbc, status_params->outputs[i].trackedBox, x, y);
+					found = true;
+				}
+			}
+		}
 
-	return true;
-}
+		if (!fits)
+		{
+			blog(LOG_WARNING, "NvFBC: Ignoring stitch layout entry \"%.*s\", it exceeds the maximum texture size of %u", (int)len, p, max_texture_size);
+		}
+		else if (!found && len != 0)
+		{
+			blog(LOG_WARNING, "NvFBC: Ignoring stitch layout entry \"%.*s\"", (int)len, p);
+		}
 
-#if !defined(_WIN32) || !_WIN32
-static long get_current_desktop(Display *dpy)
-{
-	Atom type;
-	int format;
-	unsigned long count, remaining;
-	unsigned char *data;
-	int status = XGetWindowProperty(dpy, DefaultRootWindow(dpy), _NET_CURRENT_DESKTOP, 0, 1, False, XA_CARDINAL, &type, &format, &count, &remaining, &data);
-	if (status != Success)
-	{
-		return -1;
+		p += end != NULL ? len + 1 : len;
 	}
-	if (type != XA_CARDINAL || format != 32 || count != 1 || remaining != 0)
+
+check_count:;
+	if (data_nvfbc->stitch_count == 0)
 	{
-		XFree(data);
-		return -1;
+		blog(LOG_WARNING, "%s", "NvFBC: Stitch layout has no valid outputs, capturing the entire desktop");
 	}
-	long ret = *(long *)data;
-	XFree(data);
-	return ret;
 }
 
-static bool is_desktop_visible(data_t *data)
+#define FOLLOW_MARGIN 128
+#define FOLLOW_REBUILD_INTERVAL_NS 250000000ULL
+
+static bool uses_follow_box(const data_settings_t *settings)
 {
-	if (data->settings.desktop == -1)
+	return settings->screen == SCREEN_WINDOW || settings->screen == SCREEN_CURSOR;
+}
+
+/* The zoom box moves with every pointer move, give it room to move in. */
+static uint32_t get_follow_margin(const data_settings_t *settings)
+{
+#if !defined(_WIN32) || !_WIN32
+	if (settings->screen == SCREEN_CURSOR)
 	{
-		return true;
+		uint32_t margin = (settings->zoom_width > settings->zoom_height ? settings->zoom_width : settings->zoom_height) / 2;
+		return margin > FOLLOW_MARGIN ? margin : FOLLOW_MARGIN;
 	}
+#endif
 
-	long current_desktop = get_current_desktop(data->x11.dpy);
-	return current_desktop >= 0 && current_desktop == data->settings.desktop;
+	return FOLLOW_MARGIN;
 }
-#endif
 
-static bool update_texture(data_t *data)
+static bool box_contains(const NVFBC_BOX *outer, const NVFBC_BOX *inner)
 {
-	int error = pthread_mutex_lock(&data->nvfbc.session_mutex);
-	if (error != 0)
-	{
-		blog(LOG_ERROR, "Mutex lock error: %s", strerror(error));
-		goto nvfbc_lock_err;
-	}
+	return inner->x >= outer->x && inner->y >= outer->y && inner->x + inner->w <= outer->x + outer->w && inner->y + inner->h <= outer->y + outer->h;
+}
 
-	if (!data->nvfbc.has_capture_session)
+/* Sets the part of the capture box that shows the followed box. A box that is partly outside is
+	shifted inside while it fits, so the source keeps its size until the next capture session. */
+static void update_follow_view(data_nvfbc_t *data_nvfbc)
+{
+	const NVFBC_BOX *follow = &data_nvfbc->follow_box;
+	const NVFBC_BOX *capture = &data_nvfbc->capture_box;
+
+	if (follow->w <= capture->w && follow->h <= capture->h)
 	{
-		goto no_capture_session;
+		uint32_t x = follow->x < capture->x ? capture->x : follow->x;
+		uint32_t y = follow->y < capture->y ? capture->y : follow->y;
+		x = x + follow->w > capture->x + capture->w ? capture->x + capture->w - follow->w : x;
+		y = y + follow->h > capture->y + capture->h ? capture->y + capture->h - follow->h : y;
+
+		data_nvfbc->view = (NVFBC_BOX){x - capture->x, y - capture->y, follow->w, follow->h};
+		return;
 	}
 
-#if !defined(_WIN32) || !_WIN32
-	/* Check desktop here to avoid capturing the desktop if not necessary. */
-	if (!is_desktop_visible(data))
+	uint32_t left = follow->x > capture->x ? follow->x : capture->x;
+	uint32_t top = follow->y > capture->y ? follow->y : capture->y;
+	uint32_t right = follow->x + follow->w < capture->x + capture->w ? follow->x + follow->w : capture->x + capture->w;
+	uint32_t bottom = follow->y + follow->h < capture->y + capture->h ? follow->y + follow->h : capture->y + capture->h;
+	if (right <= left || bottom <= top)
 	{
-		data->x11.visible_transition = (data->settings.fps + 5) / -6;
-		goto desktop_hidden;
+		return;
 	}
-#endif
 
-	if (!switch_to_nvfbc_context(&data->nvfbc))
+	data_nvfbc->view = (NVFBC_BOX){left - capture->x, top - capture->y, right - left, bottom - top};
+}
+
+/* Grows the followed box by a margin so moves can be followed without a new capture session. */
+static void update_capture_box(data_nvfbc_t *data_nvfbc, const NVFBC_GET_STATUS_PARAMS *status_params, uint32_t margin)
+{
+	const NVFBC_BOX *follow = &data_nvfbc->follow_box;
+	uint32_t screen_w = status_params->screenSize.w;
+	uint32_t screen_h = status_params->screenSize.h;
+
+	data_nvfbc->follow_w = follow->w;
+	data_nvfbc->follow_h = follow->h;
+
+	if (follow->w == 0 || follow->h == 0 || follow->x >= screen_w || follow->y >= screen_h)
 	{
-		goto enter_ctx_failed;
+		data_nvfbc->capture_box = (NVFBC_BOX){0, 0, screen_w, screen_h};
+		data_nvfbc->view = data_nvfbc->capture_box;
+		return;
 	}
 
-	GLuint nvfbc_tex;
-	NVFBC_FRAME_GRAB_INFO info;
+	uint32_t left = follow->x > margin ? follow->x - margin : 0;
+	uint32_t top = follow->y > margin ? follow->y - margin : 0;
+	uint32_t right = follow->x + follow->w + margin < screen_w ? follow->x + follow->w + margin : screen_w;
+	uint32_t bottom = follow->y + follow->h + margin < screen_h ? follow->y + follow->h + margin : screen_h;
+
+	data_nvfbc->capture_box = (NVFBC_BOX){left, top, right - left, bottom - top};
+	update_follow_view(data_nvfbc);
+}
+
+/* Remembers where the captured region sits on the X screen. */
+static void update_tracked_box(data_nvfbc_t *data_nvfbc, data_settings_t *settings)
+{
+	NVFBC_GET_STATUS_PARAMS status_params = {
+		.dwVersion = NVFBC_GET_STATUS_PARAMS_VER};
+
+	data_nvfbc->tracked_box = (NVFBC_BOX){0};
+	data_nvfbc->stitch_count = 0;
 
-	if (!capture_frame(&data->nvfbc, &nvfbc_tex, &info))
+	if (!get_nvfbc_status(data_nvfbc->nvfbc_session, &status_params))
 	{
-		goto capture_frame_err;
+		return;
 	}
 
-	switch_to_obs_context(&data->nvfbc);
-
-#if !defined(_WIN32) || !_WIN32
-	/* Wait a few frames to make sure the old desktop is never visible. */
-	if (data->x11.visible_transition + 1 < 0)
+	if (settings->screen == -1 || settings->screen == SCREEN_STITCHED)
 	{
-		if (info.bIsNewFrame == NVFBC_TRUE)
+		data_nvfbc->tracked_box.w = status_params.screenSize.w;
+		data_nvfbc->tracked_box.h = status_params.screenSize.h;
+		if (settings->screen == SCREEN_STITCHED)
 		{
-			++data->x11.visible_transition;
+			update_stitch_layout(data_nvfbc, settings, &status_params);
 		}
-		goto desktop_hidden;
+		return;
 	}
-	if (data->x11.visible_transition + 1 == 0)
+
+	if (uses_follow_box(settings))
+	{
+		update_capture_box(data_nvfbc, &status_params, get_follow_margin(settings));
+		data_nvfbc->tracked_box = data_nvfbc->capture_box;
+		return;
+	}
+
+	for (uint32_t i = 0; i < status_params.dwOutputNum; i++)
 	{
-		if (info.bIsNewFrame == NVFBC_FALSE)
+		if (status_params.outputs[i].dwId == (uint32_t)settings->screen)
 		{
-			goto desktop_hidden;
+			data_nvfbc->tracked_box = status_params.outputs[i].trackedBox;
+			return;
 		}
-		++data->x11.visible_transition;
 	}
+}
 
-	/* Need to check again to avoid a "race condition". */
-	if (!is_desktop_visible(data))
+static bool use_capture_thread(const data_settings_t *settings)
+{
+	return settings->threaded || settings->low_latency;
+}
+
+/* NvFBC's sampling rate is set in whole milliseconds, so only OBS frame intervals that are a whole
+	number of milliseconds, like at 50 or 100 FPS, can be locked to. At 30 or 60 FPS the
+	sampling phase would walk off the tick within a second. */
+static bool is_lockable_interval(uint64_t interval_ns)
+{
+	int64_t sampling_ns = (int64_t)((interval_ns + 500000) / 1000000) * 1000000;
+	return interval_ns != 0 && llabs(sampling_ns - (int64_t)interval_ns) <= SCHED_LOCKABLE_ERROR_NS;
+}
+
+static bool use_phase_lock(const data_settings_t *settings)
+{
+	return settings->phase_lock && !settings->push_model && !settings->auto_model && !use_capture_thread(settings) && is_lockable_interval(get_obs_frame_interval_ns());
+}
+
+static uint32_t get_sampling_rate_ms(data_settings_t *settings)
+{
+	/* Phase locking only works if NvFBC samples at the OBS frame rate. */
+	uint64_t interval_ns = use_phase_lock(settings) ? get_obs_frame_interval_ns() : 0;
+	if (interval_ns != 0)
 	{
-		data->x11.visible_transition = (data->settings.fps + 5) / -6;
-		goto desktop_hidden;
+		return (interval_ns + 500000) / 1000000;
 	}
-#endif
 
-	error = pthread_mutex_lock(&data->tex.texture_mutex);
-	if (error != 0)
+	return 1000.0 / settings->fps + 0.5;
+}
+
+static bool setup_capture_session(data_nvfbc_t *data_nvfbc, data_settings_t *settings)
+{
+	if (data_nvfbc->has_capture_session)
 	{
-		blog(LOG_ERROR, "Mutex lock error: %s", strerror(error));
-		goto tex_lock_err;
+		return false;
 	}
 
-	if (need_texture_resize(&data->tex, info.dwWidth, info.dwHeight))
+	NVFBC_SIZE frame_size = {0};
+	NVFBC_BOX capture_box = {0};
+	if (uses_follow_box(settings))
 	{
-		if (!resize_texture(&data->tex, info.dwWidth, info.dwHeight))
-		{
-			goto tex_create_failed;
-		}
+		update_tracked_box(data_nvfbc, settings);
+		capture_box = data_nvfbc->capture_box;
+		data_nvfbc->rebuild_ns = os_gettime_ns();
 	}
-	else if (!info.bIsNewFrame)
+	else if (data_nvfbc->scale_step != 0 && settings->screen != SCREEN_STITCHED)
 	{
-		goto omit_tex_copy;
+		update_tracked_box(data_nvfbc, settings);
+		frame_size.w = data_nvfbc->tracked_box.w * scale_percents[data_nvfbc->scale_step] / 100;
+		frame_size.h = data_nvfbc->tracked_box.h * scale_percents[data_nvfbc->scale_step] / 100;
 	}
 
-#if _WIN32
-	p_wglCopyImageSubDataNV(
+	NVFBC_CREATE_CAPTURE_SESSION_PARAMS cap_params = {
+		.dwVersion = NVFBC_CREATE_CAPTURE_SESSION_PARAMS_VER,
+		.eCaptureType = NVFBC_CAPTURE_TO_GL,
+		.eTrackingType = settings->screen < 0 ? NVFBC_TRACKING_SCREEN : NVFBC_TRACKING_OUTPUT,
+		.dwOutputId = settings->screen,
+#if !defined(_WIN32) || !_WIN32
+		.bWithCursor = settings->show_cursor && !settings->cursor_overlay ? NVFBC_TRUE : NVFBC_FALSE,
 #else
-	p_glXCopyImageSubDataNV(
-		data->x11.dpy,
+		.bWithCursor = settings->show_cursor ? NVFBC_TRUE : NVFBC_FALSE,
 #endif
-		data->nvfbc.nvfbc_ctx, nvfbc_tex, data->nvfbc.togl_setup_params.dwTexTarget, 0, 0, 0, 0,
-		NULL, *(GLuint *)gs_texture_get_obj(data->tex.texture), GL_TEXTURE_2D, 0, 0, 0, 0,
-		info.dwWidth, info.dwHeight, 1);
-
-	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
-	assert(error == 0);
+		.bDisableAutoModesetRecovery = NVFBC_FALSE,
+		.captureBox = capture_box,
+		.frameSize = frame_size,
+		.bRoundFrameSize = NVFBC_TRUE,
+		.dwSamplingRateMs = get_sampling_rate_ms(settings),
+		.bPushModel = data_nvfbc->push_model ? NVFBC_TRUE : NVFBC_FALSE,
+		.bAllowDirectCapture = settings->direct_capture ? NVFBC_TRUE : NVFBC_FALSE,
+	};
 
-	GLenum glerr = glGetError();
-	if (glerr != GL_NO_ERROR)
+	NVFBCSTATUS ret = nvFBC.nvFBCCreateCaptureSession(data_nvfbc->nvfbc_session, &cap_params);
+	if (ret != NVFBC_SUCCESS)
 	{
-#if _WIN32
-		blog(LOG_ERROR, "wglCopyImageSubDataNV GL error: %x", glerr);
-#else
-		blog(LOG_ERROR, "glXCopyImageSubDataNV GL error: %x", glerr);
-#endif
-		goto tex_copy_failed;
+		blog(LOG_ERROR, "%s", nvFBC.nvFBCGetLastErrorStr(data_nvfbc->nvfbc_session));
+		return false;
 	}
 
-	error = pthread_mutex_unlock(&data->tex.texture_mutex);
-	assert(error == 0);
-
-	return true;
-
-omit_tex_copy:;
-	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
-	assert(error == 0);
-	error = pthread_mutex_unlock(&data->tex.texture_mutex);
-	assert(error == 0);
+	data_nvfbc->togl_setup_params = (NVFBC_TOGL_SETUP_PARAMS){
+		.dwVersion = NVFBC_TOGL_SETUP_PARAMS_VER,
+		.eBufferFormat = NVFBC_BUFFER_FORMAT_RGBA,
+		.bWithDiffMap = NVFBC_FALSE,
+		.dwDiffMapScalingFactor = 1};
+
+	ret = nvFBC.nvFBCToGLSetUp(data_nvfbc->nvfbc_session, &data_nvfbc->togl_setup_params);
+	if (ret != NVFBC_SUCCESS)
+	{
+		blog(LOG_ERROR, "%s", nvFBC.nvFBCGetLastErrorStr(data_nvfbc->nvfbc_session));
+		goto setup_error;
+	}
+
+	data_nvfbc->has_capture_session = true;
+	data_nvfbc->session_id++;
+	data_nvfbc->force_refresh = true;
+	update_tracked_box(data_nvfbc, settings);
+
+	return true;
+
+setup_error:;
+	NVFBC_DESTROY_CAPTURE_SESSION_PARAMS destroy_cap_params = {
+		.dwVersion = NVFBC_DESTROY_CAPTURE_SESSION_PARAMS_VER,
+	};
+
+	ret = nvFBC.nvFBCDestroyCaptureSession(data_nvfbc->nvfbc_session, &destroy_cap_params);
+	if (ret != NVFBC_SUCCESS)
+	{
+		blog(LOG_WARNING, "%s", nvFBC.nvFBCGetLastErrorStr(data_nvfbc->nvfbc_session));
+	}
+
+	return false;
+}
+
+static bool create_capture_session(data_nvfbc_t *data_nvfbc, data_settings_t *settings)
+{
+	stage_start(profile_create_session_name);
+	bool created = setup_capture_session(data_nvfbc, settings);
+	stage_end(profile_create_session_name);
+
+	return created;
+}
+
+static void destroy_capture_session(data_nvfbc_t *data_nvfbc)
+{
+	if (!data_nvfbc->has_capture_session)
+	{
+		return;
+	}
+
+	stage_start(profile_destroy_session_name);
+
+	NVFBC_DESTROY_CAPTURE_SESSION_PARAMS destroy_cap_params = {
+		.dwVersion = NVFBC_DESTROY_CAPTURE_SESSION_PARAMS_VER};
+
+	NVFBCSTATUS ret = nvFBC.nvFBCDestroyCaptureSession(data_nvfbc->nvfbc_session, &destroy_cap_params);
+	if (ret != NVFBC_SUCCESS)
+	{
+		blog(LOG_WARNING, "%s", nvFBC.nvFBCGetLastErrorStr(data_nvfbc->nvfbc_session));
+	}
+
+	data_nvfbc->has_capture_session = false;
+	stage_end(profile_destroy_session_name);
+}
+
+static bool capture_frame(data_nvfbc_t *data_nvfbc, uint32_t flags, uint32_t timeout_ms, GLuint *out_texture, NVFBC_FRAME_GRAB_INFO *out_info)
+{
+	if (!data_nvfbc->has_capture_session)
+	{
+		return false;
+	}
+
+	NVFBC_TOGL_GRAB_FRAME_PARAMS grab_params = {
+		.dwVersion = NVFBC_TOGL_GRAB_FRAME_PARAMS_VER,
+		.dwFlags = flags,
+		.pFrameGrabInfo = out_info,
+		.dwTimeoutMs = timeout_ms};
+
+	NVFBCSTATUS ret = nvFBC.nvFBCToGLGrabFrame(data_nvfbc->nvfbc_session, &grab_params);
+	if (ret != NVFBC_SUCCESS)
+	{
+		blog(LOG_ERROR, "%s", nvFBC.nvFBCGetLastErrorStr(data_nvfbc->nvfbc_session));
+		return false;
+	}
+
+	*out_texture = data_nvfbc->togl_setup_params.dwTextures[grab_params.dwTextureIndex];
+
+	return true;
+}
+
+static bool need_texture_resize(data_texture_t *data_texture, uint32_t width, uint32_t height)
+{
+	return data_texture->texture == NULL || width != data_texture->width || height != data_texture->height;
+}
+
+static bool resize_texture(data_texture_t *data_texture, uint32_t width, uint32_t height)
+{
+	if (data_texture->texture != NULL)
+	{
+		gs_texture_destroy(data_texture->texture);
+	}
+
+	data_texture->texture = gs_texture_create(width, height, GS_RGBA, 1, NULL, GS_DYNAMIC);
+	if (data_texture->texture == NULL)
+	{
+		return false;
+	}
+
+	/* HACK: OBS's graphics api doesn't support creating a texture with internal format GL_RGBA8,
+		which is required by *CopyImageSubDataNV because the NvFBC texture has that format. */
+	GLuint new_tex;
+	glGenTextures(1, &new_tex);
+	glBindTexture(GL_TEXTURE_2D, new_tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	GLuint old_tex = *(GLuint *)gs_texture_get_obj(data_texture->texture);
+	*(GLuint *)gs_texture_get_obj(data_texture->texture) = new_tex;
+	glDeleteTextures(1, &old_tex);
+
+	data_texture->width = width;
+	data_texture->height = height;
+	data_texture->has_mipmaps = false;
+	data_texture->small_draw_ns = 0;
+
 	return true;
+}
+
+#define MIP_SCALE_THRESHOLD 0.5f
+#define MIP_HOLD_NS 1000000000ULL
+
+/* Must be called within the OBS graphics context. The mip chain is only built for new frames while
+	some view drew the source at less than half its size within the last second. */
+static void update_mipmaps(data_texture_t *data_texture)
+{
+	bool wanted = data_texture->small_draw_ns != 0 && os_gettime_ns() - data_texture->small_draw_ns < MIP_HOLD_NS;
+	if (!wanted && !data_texture->has_mipmaps)
+	{
+		return;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, *(GLuint *)gs_texture_get_obj(data_texture->texture));
+	if (wanted)
+	{
+		glGenerateMipmap(GL_TEXTURE_2D);
+		if (!data_texture->has_mipmaps)
+		{
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		}
+	}
+	else
+	{
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	data_texture->has_mipmaps = wanted;
+}
+
+/* Remembers when the texture was last drawn at less than half its size. Views like the preview and
+	the multiview tiles draw the canvas with an ortho projection of its base size into a smaller
+	viewport, which scales on top of the world matrix. libobs has no getter for the projection, so
+	the base size stands in for it. That guess is wrong wherever the projection is not the base
+	canvas: source projectors, nested scenes and filters render at the size of their source, so
+	the scale comes out too small or too large by the ratio between that size and the canvas. */
+static void note_draw_scale(data_texture_t *data_texture)
+{
+	struct matrix4 world;
+	gs_matrix_get(&world);
+
+	float view_x = 1.0f, view_y = 1.0f;
+	struct obs_video_info ovi;
+	struct gs_rect viewport;
+	gs_get_viewport(&viewport);
+	if (obs_get_video_info(&ovi) && ovi.base_width != 0 && ovi.base_height != 0 && viewport.cx > 0 && viewport.cy > 0)
+	{
+		view_x = (float)viewport.cx / ovi.base_width;
+		view_y = (float)viewport.cy / ovi.base_height;
+	}
+
+	float scale_x = sqrtf(world.x.x * world.x.x + world.x.y * world.x.y) * view_x * data_texture->display_width / data_texture->width;
+	float scale_y = sqrtf(world.y.x * world.y.x + world.y.y * world.y.y) * view_y * data_texture->display_height / data_texture->height;
+	if ((scale_x > scale_y ? scale_x : scale_y) < MIP_SCALE_THRESHOLD)
+	{
+		data_texture->small_draw_ns = os_gettime_ns();
+	}
+}
+
+static void clear_texture(data_texture_t *data_texture)
+{
+	void *zeros = bzalloc(data_texture->width * data_texture->height * 4);
+	if (zeros == NULL)
+	{
+		return;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, *(GLuint *)gs_texture_get_obj(data_texture->texture));
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, data_texture->width, data_texture->height, GL_RGBA, GL_UNSIGNED_BYTE, zeros);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	bfree(zeros);
+}
+
+#if !defined(_WIN32) || !_WIN32
+static long get_current_desktop(Display *dpy)
+{
+	Atom type;
+	int format;
+	unsigned long count, remaining;
+	unsigned char *data;
+	int status = XGetWindowProperty(dpy, DefaultRootWindow(dpy), _NET_CURRENT_DESKTOP, 0, 1, False, XA_CARDINAL, &type, &format, &count, &remaining, &data);
+	if (status != Success)
+	{
+		return -1;
+	}
+	if (type != XA_CARDINAL || format != 32 || count != 1 || remaining != 0)
+	{
+		XFree(data);
+		return -1;
+	}
+	long ret = *(long *)data;
+	XFree(data);
+	return ret;
+}
+
+static bool is_desktop_visible(data_t *data)
+{
+	if (data->settings.desktop == -1)
+	{
+		return true;
+	}
+
+	long current_desktop = get_current_desktop(data->x11.dpy);
+	return current_desktop >= 0 && current_desktop == data->settings.desktop;
+}
+#endif
+
+/* Least squares line through the window minima. */
+static void clock_sync_fit(clock_sync_t *clock)
+{
+	uint32_t n = clock->min_count;
+	uint64_t base_ns = clock->min_local_ns[(clock->min_next + CLOCK_SYNC_WINDOWS - n) % CLOCK_SYNC_WINDOWS];
+	int64_t base_offset_ns = clock->min_offset_ns[(clock->min_next + CLOCK_SYNC_WINDOWS - n) % CLOCK_SYNC_WINDOWS];
+
+	double mean_t = 0.0, mean_o = 0.0;
+	for (uint32_t i = 0; i < n; i++)
+	{
+		mean_t += (double)(clock->min_local_ns[i] - base_ns);
+		mean_o += (double)(clock->min_offset_ns[i] - base_offset_ns);
+	}
+	mean_t /= n;
+	mean_o /= n;
+
+	double cov = 0.0, var = 0.0;
+	for (uint32_t i = 0; i < n; i++)
+	{
+		double t = (double)(clock->min_local_ns[i] - base_ns) - mean_t;
+		cov += t * ((double)(clock->min_offset_ns[i] - base_offset_ns) - mean_o);
+		var += t * t;
+	}
+
+	double drift = var > 0.0 ? cov / var : 0.0;
+	if (drift > CLOCK_SYNC_MAX_DRIFT || drift < -CLOCK_SYNC_MAX_DRIFT)
+	{
+		drift = 0.0;
+	}
+
+	clock->ref_local_ns = base_ns + (uint64_t)mean_t;
+	clock->offset_ns = base_offset_ns + (int64_t)mean_o;
+	clock->drift = drift;
+}
+
+static void clock_sync_update(clock_sync_t *clock, uint64_t local_ns, uint64_t remote_us)
+{
+	int64_t offset_ns = (int64_t)local_ns - (int64_t)(remote_us * 1000);
+
+	if (!clock->valid)
+	{
+		memset(clock, 0, sizeof(*clock));
+		clock->offset_ns = offset_ns;
+		clock->ref_local_ns = local_ns;
+		clock->window_min_ns = offset_ns;
+		clock->window_min_local_ns = local_ns;
+		clock->window_start_ns = local_ns;
+		clock->valid = true;
+		return;
+	}
+
+	if (offset_ns < clock->window_min_ns)
+	{
+		clock->window_min_ns = offset_ns;
+		clock->window_min_local_ns = local_ns;
+	}
+
+	/* Follow the plain minimum until the first window is complete. */
+	if (clock->min_count == 0 && offset_ns < clock->offset_ns)
+	{
+		clock->offset_ns = offset_ns;
+		clock->ref_local_ns = local_ns;
+	}
+
+	if (local_ns - clock->window_start_ns < CLOCK_SYNC_WINDOW_NS)
+	{
+		return;
+	}
+
+	clock->min_offset_ns[clock->min_next] = clock->window_min_ns;
+	clock->min_local_ns[clock->min_next] = clock->window_min_local_ns;
+	clock->min_next = (clock->min_next + 1) % CLOCK_SYNC_WINDOWS;
+	if (clock->min_count < CLOCK_SYNC_WINDOWS)
+	{
+		clock->min_count++;
+	}
+	clock_sync_fit(clock);
+
+	clock->window_min_ns = offset_ns;
+	clock->window_min_local_ns = local_ns;
+	clock->window_start_ns = local_ns;
+}
+
+static uint64_t clock_sync_to_local(const clock_sync_t *clock, uint64_t remote_us)
+{
+	int64_t remote_ns = (int64_t)(remote_us * 1000);
+
+	/* The offset depends on the local time being solved for, one step is plenty at ppm drift. */
+	int64_t local_ns = remote_ns + clock->offset_ns;
+	return local_ns + (int64_t)(clock->drift * (double)(local_ns - (int64_t)clock->ref_local_ns));
+}
+
+/* Must be called with the session mutex held right after a grab. Returns when the frame was
+	rendered, in os_gettime_ns() time. */
+static uint64_t timestamp_frame(data_t *data, const NVFBC_FRAME_GRAB_INFO *info, uint64_t now)
+{
+	clock_sync_t *clock = &data->sched.clock;
+
+	if (info->bIsNewFrame)
+	{
+		clock_sync_update(clock, now, info->ulTimestampUs);
+	}
+
+	uint64_t frame_ns = clock_sync_to_local(clock, info->ulTimestampUs);
+	return frame_ns < now ? frame_ns : now;
+}
+
+static void latency_hist_add(latency_hist_t *hist, uint64_t latency_ns)
+{
+	uint64_t bucket = latency_ns / 1000000;
+	if (bucket >= LATENCY_HIST_BUCKETS)
+	{
+		bucket = LATENCY_HIST_BUCKETS - 1;
+	}
+
+	++hist->buckets[bucket];
+	++hist->count;
+	if (latency_ns > hist->max_ns)
+	{
+		hist->max_ns = latency_ns;
+	}
+}
+
+static uint32_t latency_hist_percentile(const latency_hist_t *hist, uint32_t percent)
+{
+	uint64_t target = ((uint64_t)hist->count * percent + 99) / 100;
+	uint64_t sum = 0;
+
+	for (uint32_t i = 0; i < LATENCY_HIST_BUCKETS; i++)
+	{
+		sum += hist->buckets[i];
+		if (sum >= target)
+		{
+			return i + 1;
+		}
+	}
+
+	return LATENCY_HIST_BUCKETS;
+}
+
+static void sched_report(data_t *data)
+{
+	data_sched_t *sched = &data->sched;
+
+	if (sched->hist.count == 0)
+	{
+		return;
+	}
+
+	blog(LOG_INFO, "NvFBC source '%s': frame age at render over %u frames: p50 < %u ms, p90 < %u ms, p99 < %u ms, max %.1f ms, "
+		"%u phase re-arms, %u skipped within the %.2f ms jitter band, clock drift %+.1f ppm",
+		obs_source_get_name(data->obs.source), sched->hist.count,
+		latency_hist_percentile(&sched->hist, 50), latency_hist_percentile(&sched->hist, 90),
+		latency_hist_percentile(&sched->hist, 99), sched->hist.max_ns / 1000000.0, sched->rearm_count,
+		sched->rearm_skipped, sched->jitter_ns / 1000000.0, sched->clock.drift * 1000000.0);
+
+	memset(&sched->hist, 0, sizeof(sched->hist));
+	sched->rearm_count = 0;
+	sched->rearm_skipped = 0;
+}
+
+/* Called whenever the capture session got (re)created and NvFBC's sampling phase is unknown. */
+static void sched_reset(data_sched_t *sched, data_settings_t *settings, bool settling)
+{
+	uint64_t now = os_gettime_ns();
+
+	sched->phase_err_sum_ns = 0;
+	sched->phase_err_count = 0;
+	sched->settling = settling;
+	sched->cooldown_ns = now + (settling ? 0 : SCHED_COOLDOWN_NS);
+	sched->rearm_ns = 0;
+
+	uint64_t interval_ns = get_obs_frame_interval_ns();
+	if (settings->phase_lock && !settling && !is_lockable_interval(interval_ns))
+	{
+		blog(LOG_WARNING, "NvFBC samples in whole milliseconds, the OBS frame interval of %.3f ms can not be phase-locked, phase lock stays off",
+			interval_ns / 1000000.0);
+	}
+
+	if (!use_phase_lock(settings))
+	{
+		return;
+	}
+
+	sched->interval_ns = interval_ns;
+	int64_t sampling_ns = (int64_t)get_sampling_rate_ms(settings) * 1000000;
+	/* The timer ticks in whole milliseconds, and the rounded rate walks off the OBS interval over a window. */
+	sched->jitter_ns = SCHED_TOLERANCE_NS + llabs(sampling_ns - (int64_t)sched->interval_ns) * SCHED_WINDOW_FRAMES;
+}
+
+#if !defined(_WIN32) || !_WIN32
+/* Parses a CPU list like "0-3,8,10-11", the same format taskset and isolcpus take. */
+static bool parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+
+	const char *p = list;
+	while (*p != '\0')
+	{
+		char *end;
+		long first = strtol(p, &end, 10);
+		if (end == p || first < 0)
+		{
+			return false;
+		}
+
+		long last = first;
+		p = end;
+		if (*p == '-')
+		{
+			last = strtol(++p, &end, 10);
+			if (end == p || last < first)
+			{
+				return false;
+			}
+			p = end;
+		}
+
+		if (last >= CPU_SETSIZE)
+		{
+			return false;
+		}
+
+		for (long cpu = first; cpu <= last; cpu++)
+		{
+			CPU_SET(cpu, set);
+		}
+
+		while (*p == ' ')
+		{
+			p++;
+		}
+
+		if (*p == ',')
+		{
+			p++;
+		}
+		else if (*p != '\0')
+		{
+			return false;
+		}
+	}
+
+	return CPU_COUNT(set) > 0;
+}
+
+/* Raising the nice value of a single thread needs CAP_SYS_NICE or a high enough RLIMIT_NICE. */
+static void raise_thread_nice(pid_t tid, const char *name)
+{
+	int nice = THREAD_HIGH_NICE;
+
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NICE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && 20 - (int)limit.rlim_cur > nice)
+	{
+		nice = 20 - (int)limit.rlim_cur;
+	}
+
+	if (nice >= 0)
+	{
+		blog(LOG_WARNING, "NvFBC: Not allowed to raise the priority of the %s thread, keeping the default", name);
+		return;
+	}
+
+	if (setpriority(PRIO_PROCESS, tid, nice) != 0)
+	{
+		blog(LOG_WARNING, "NvFBC: Could not set nice %d on the %s thread: %s", nice, name, strerror(errno));
+		return;
+	}
+
+	blog(LOG_INFO, "NvFBC: Running the %s thread at nice %d", name, nice);
+}
+
+/* Applied by each thread to itself. Anything the process may not do is logged and skipped. */
+static void apply_thread_policy(const data_settings_t *settings, const char *name)
+{
+	if (settings->thread_priority == THREAD_PRIORITY_FIFO || settings->thread_priority == THREAD_PRIORITY_RR)
+	{
+		int policy = settings->thread_priority == THREAD_PRIORITY_FIFO ? SCHED_FIFO : SCHED_RR;
+		struct sched_param param = {.sched_priority = THREAD_RT_PRIORITY};
+
+		int error = pthread_setschedparam(pthread_self(), policy, &param);
+		if (error == 0)
+		{
+			blog(LOG_INFO, "NvFBC: Running the %s thread with %s priority %d", name, policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR", THREAD_RT_PRIORITY);
+		}
+		else
+		{
+			blog(LOG_WARNING, "NvFBC: Could not switch the %s thread to %s: %s", name, policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR", strerror(error));
+			raise_thread_nice(syscall(SYS_gettid), name);
+		}
+	}
+	else if (settings->thread_priority == THREAD_PRIORITY_HIGH)
+	{
+		raise_thread_nice(syscall(SYS_gettid), name);
+	}
+
+	if (settings->has_affinity)
+	{
+		int error = pthread_setaffinity_np(pthread_self(), sizeof(settings->affinity), &settings->affinity);
+		if (error != 0)
+		{
+			blog(LOG_WARNING, "NvFBC: Could not pin the %s thread to the selected CPUs: %s", name, strerror(error));
+		}
+	}
+
+	if (settings->timer_slack_us != 0 && prctl(PR_SET_TIMERSLACK, (unsigned long)settings->timer_slack_us * 1000, 0, 0, 0) != 0)
+	{
+		blog(LOG_WARNING, "NvFBC: Could not set the timer slack of the %s thread: %s", name, strerror(errno));
+	}
+}
+#endif
+
+static void *sched_thread(void *p)
+{
+	data_t *data = p;
+
+	os_set_thread_name("nvfbc-sched");
+	trace_set_thread_name("nvfbc-sched");
+#if !defined(_WIN32) || !_WIN32
+	apply_thread_policy(&data->settings, "phase-lock");
+#endif
+
+	while (os_event_wait(data->sched.event) == 0 && !data->sched.stop)
+	{
+		pthread_mutex_lock(&data->nvfbc.session_mutex);
+		uint64_t rearm_ns = data->sched.rearm_ns;
+		pthread_mutex_unlock(&data->nvfbc.session_mutex);
+
+		if (rearm_ns == 0)
+		{
+			continue;
+		}
+
+		/* NvFBC starts its sampling timer with the capture session. */
+		os_sleepto_ns(rearm_ns);
+
+		pthread_mutex_lock(&data->nvfbc.session_mutex);
+		pthread_mutex_lock(&data->nvfbc.grab_mutex);
+		if (data->sched.rearm_ns == rearm_ns && data->nvfbc.has_capture_session && enter_nvfbc_context(&data->nvfbc))
+		{
+			destroy_capture_session(&data->nvfbc);
+			create_capture_session(&data->nvfbc, &data->settings);
+			leave_nvfbc_context(&data->nvfbc);
+
+			++data->sched.rearm_count;
+			sched_reset(&data->sched, &data->settings, true);
+		}
+		data->sched.rearm_ns = 0;
+		pthread_mutex_unlock(&data->nvfbc.grab_mutex);
+		pthread_mutex_unlock(&data->nvfbc.session_mutex);
+	}
+
+	return NULL;
+}
+
+static bool start_sched_thread(data_sched_t *sched, data_t *data)
+{
+	if (sched->has_thread)
+	{
+		return true;
+	}
+
+	if (os_event_init(&sched->event, OS_EVENT_TYPE_AUTO) != 0)
+	{
+		blog(LOG_ERROR, "%s", "Could not create scheduler event");
+		return false;
+	}
+
+	sched->stop = false;
+	int error = pthread_create(&sched->thread, NULL, sched_thread, data);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Thread creation error: %s", strerror(error));
+		os_event_destroy(sched->event);
+		sched->event = NULL;
+		return false;
+	}
+
+	sched->has_thread = true;
+
+	return true;
+}
+
+static void stop_sched_thread(data_sched_t *sched)
+{
+	if (!sched->has_thread)
+	{
+		return;
+	}
+
+	sched->stop = true;
+	os_event_signal(sched->event);
+	pthread_join(sched->thread, NULL);
+	os_event_destroy(sched->event);
+	sched->event = NULL;
+	sched->has_thread = false;
+}
+
+/* Must be called with the session mutex held. Measures how old the captured frame is when OBS
+	renders it and, in pull mode, re-arms NvFBC's sampling timer so that new frames land
+	SCHED_LEAD_NS before the OBS frame tick. */
+static void sched_update(data_t *data, const NVFBC_FRAME_GRAB_INFO *info, uint64_t frame_ns)
+{
+	data_sched_t *sched = &data->sched;
+	uint64_t now = os_gettime_ns();
+	uint64_t tick_ns = obs_get_video_frame_time();
+
+	/* Only account once per OBS frame. */
+	if (!sched->clock.valid || tick_ns == sched->last_tick_ns)
+	{
+		return;
+	}
+	sched->last_tick_ns = tick_ns;
+
+	latency_hist_add(&sched->hist, now > frame_ns ? now - frame_ns : 0);
+
+	if (sched->report_ns == 0)
+	{
+		sched->report_ns = now;
+	}
+	else if (now - sched->report_ns >= SCHED_REPORT_INTERVAL_NS)
+	{
+		if (data->settings.phase_lock || data->settings.low_latency)
+		{
+			sched_report(data);
+		}
+		sched->report_ns = now;
+	}
+
+	if (!use_phase_lock(&data->settings) || !info->bIsNewFrame)
+	{
+		return;
+	}
+
+	int64_t interval = sched->interval_ns;
+	int64_t err = ((int64_t)(frame_ns - tick_ns) + SCHED_LEAD_NS) % interval;
+	if (err < -interval / 2)
+	{
+		err += interval;
+	}
+	else if (err >= interval / 2)
+	{
+		err -= interval;
+	}
+
+	sched->phase_err_sum_ns += err;
+	if (++sched->phase_err_count < SCHED_WINDOW_FRAMES)
+	{
+		return;
+	}
+
+	int64_t mean_err = sched->phase_err_sum_ns / sched->phase_err_count;
+	sched->phase_err_sum_ns = 0;
+	sched->phase_err_count = 0;
+
+	/* The first window after a re-arm tells how late NvFBC starts sampling after session creation. */
+	if (sched->settling)
+	{
+		sched->arm_delay_ns = (sched->arm_delay_ns + mean_err) % interval;
+		sched->settling = false;
+	}
+
+	if (now < sched->cooldown_ns || sched->rearm_ns != 0)
+	{
+		return;
+	}
+
+	/* Recreating the session costs more than a phase error within the sampling jitter. */
+	if (llabs(mean_err) <= sched->jitter_ns)
+	{
+		if (llabs(mean_err) > SCHED_TOLERANCE_NS)
+		{
+			++sched->rearm_skipped;
+		}
+		return;
+	}
+
+	int64_t offset = (-SCHED_LEAD_NS - sched->arm_delay_ns) % interval;
+	if (offset < 0)
+	{
+		offset += interval;
+	}
+
+	uint64_t target = tick_ns + offset;
+	while (target < now + SCHED_REARM_MARGIN_NS)
+	{
+		target += interval;
+	}
+
+	if (!start_sched_thread(sched, data))
+	{
+		sched->cooldown_ns = now + SCHED_COOLDOWN_NS;
+		return;
+	}
+
+	sched->rearm_ns = target;
+	sched->cooldown_ns = now + SCHED_COOLDOWN_NS;
+	os_event_signal(sched->event);
+}
+
+#if !defined(_WIN32) || !_WIN32
+/* Xlib's default error handler exits the process, so requests on windows that may be gone
+	run inside a trap. The handler is process-wide, traps of our own threads take turns. */
+static pthread_mutex_t x_error_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int (*x_error_previous)(Display *, XErrorEvent *) = NULL;
+static int x_error_code = 0;
+
+static int x_error_trap_handler(Display *dpy, XErrorEvent *event)
+{
+	x_error_code = event->error_code;
+	return 0;
+}
+
+static void x_error_trap(Display *dpy)
+{
+	pthread_mutex_lock(&x_error_mutex);
+	XSync(dpy, False);
+	x_error_code = 0;
+	x_error_previous = XSetErrorHandler(x_error_trap_handler);
+}
+
+/* Returns the error code of the first failed request since x_error_trap(), or 0. */
+static int x_error_untrap(Display *dpy)
+{
+	XSync(dpy, False);
+	XSetErrorHandler(x_error_previous);
+	int code = x_error_code;
+	pthread_mutex_unlock(&x_error_mutex);
+
+	return code;
+}
+
+static void close_window_tracker(data_window_t *window)
+{
+	if (window->dpy != NULL)
+	{
+		XCloseDisplay(window->dpy);
+		window->dpy = NULL;
+	}
+
+	window->window = None;
+}
+
+static bool open_window_tracker(data_window_t *window, Window xid)
+{
+	if (window->dpy != NULL && window->window == xid)
+	{
+		return true;
+	}
+
+	close_window_tracker(window);
+	if (xid == None || xid == window->lost)
+	{
+		return false;
+	}
+
+	window->dpy = XOpenDisplay(NULL);
+	if (window->dpy == NULL)
+	{
+		blog(LOG_ERROR, "%s", "Could not open X11 display for window tracking");
+		return false;
+	}
+
+	/* A saved window may be long gone after a restart. */
+	x_error_trap(window->dpy);
+	XSelectInput(window->dpy, xid, StructureNotifyMask);
+	int error = x_error_untrap(window->dpy);
+	if (error != 0)
+	{
+		blog(LOG_WARNING, "NvFBC: Window 0x%lx is gone, keeping the last capture box", (unsigned long)xid);
+		close_window_tracker(window);
+		window->lost = xid;
+		return false;
+	}
+
+	window->window = xid;
+	window->changed = true;
+
+	return true;
+}
+
+/* Gets the window's box on the X screen, without the part left of or above the screen. */
+static bool query_window_box(data_window_t *window, NVFBC_BOX *box)
+{
+	XWindowAttributes attributes;
+	int x = 0, y = 0;
+	Window child;
+
+	/* The window can be closed at any time, also right after its events were drained. */
+	x_error_trap(window->dpy);
+	bool ok = XGetWindowAttributes(window->dpy, window->window, &attributes) &&
+		XTranslateCoordinates(window->dpy, window->window, attributes.root, 0, 0, &x, &y, &child);
+	int error = x_error_untrap(window->dpy);
+	if (error != 0)
+	{
+		if (error == BadWindow)
+		{
+			Window xid = window->window;
+			close_window_tracker(window);
+			window->lost = xid;
+		}
+		return false;
+	}
+	if (!ok)
+	{
+		return false;
+	}
+
+	int width = attributes.width;
+	int height = attributes.height;
+	if (x < 0)
+	{
+		width += x;
+		x = 0;
+	}
+	if (y < 0)
+	{
+		height += y;
+		y = 0;
+	}
+	if (width <= 0 || height <= 0)
+	{
+		return false;
+	}
+
+	*box = (NVFBC_BOX){x, y, width, height};
+	return true;
+}
+
+/* Window managers send a ConfigureNotify for moves of the frame too, so every one of them
+	is answered by asking for the position on the root window again. */
+static void update_follow_window(data_t *data)
+{
+	data_window_t *window = &data->window;
+
+	if (!open_window_tracker(window, data->settings.window))
+	{
+		return;
+	}
+
+	while (XPending(window->dpy) > 0)
+	{
+		XEvent event;
+		XNextEvent(window->dpy, &event);
+		if (event.type == ConfigureNotify || event.type == MapNotify)
+		{
+			window->changed = true;
+		}
+		else if (event.type == DestroyNotify)
+		{
+			Window xid = window->window;
+			close_window_tracker(window);
+			window->lost = xid;
+			return;
+		}
+	}
+
+	if (!window->changed)
+	{
+		return;
+	}
+	window->changed = false;
+
+	NVFBC_BOX box;
+	if (query_window_box(window, &box))
+	{
+		data->nvfbc.follow_box = box;
+	}
+}
+
+/* Centres the zoom box on the pointer and keeps it on the screen. */
+static void update_follow_cursor(data_t *data)
+{
+	data_window_t *window = &data->window;
+
+	if (window->dpy == NULL)
+	{
+		window->dpy = XOpenDisplay(NULL);
+		if (window->dpy == NULL)
+		{
+			blog(LOG_ERROR, "%s", "Could not open X11 display for cursor tracking");
+			return;
+		}
+	}
+
+	Window root, child;
+	int root_x, root_y, win_x, win_y;
+	unsigned int mask;
+	if (!XQueryPointer(window->dpy, DefaultRootWindow(window->dpy), &root, &child, &root_x, &root_y, &win_x, &win_y, &mask))
+	{
+		return;
+	}
+
+	int screen_w = DisplayWidth(window->dpy, DefaultScreen(window->dpy));
+	int screen_h = DisplayHeight(window->dpy, DefaultScreen(window->dpy));
+	int width = data->settings.zoom_width < screen_w ? data->settings.zoom_width : screen_w;
+	int height = data->settings.zoom_height < screen_h ? data->settings.zoom_height : screen_h;
+
+	int x = root_x - width / 2;
+	int y = root_y - height / 2;
+	x = x < 0 ? 0 : (x > screen_w - width ? screen_w - width : x);
+	y = y < 0 ? 0 : (y > screen_h - height ? screen_h - height : y);
+
+	data->nvfbc.follow_box = (NVFBC_BOX){x, y, width, height};
+}
+#endif
+
+/* Moves within the capture box only shift the part of the texture that is drawn. Anything else
+	needs a new capture session, but not more often than every FOLLOW_REBUILD_INTERVAL_NS. */
+static void apply_follow_box(data_nvfbc_t *data_nvfbc)
+{
+	const NVFBC_BOX *follow = &data_nvfbc->follow_box;
+
+	if (!data_nvfbc->has_capture_session || data_nvfbc->needs_rebuild || follow->w == 0 || follow->h == 0)
+	{
+		return;
+	}
+
+	if (follow->w == data_nvfbc->follow_w && follow->h == data_nvfbc->follow_h && box_contains(&data_nvfbc->capture_box, follow))
+	{
+		update_follow_view(data_nvfbc);
+		return;
+	}
+
+	if (os_gettime_ns() - data_nvfbc->rebuild_ns < FOLLOW_REBUILD_INTERVAL_NS)
+	{
+		update_follow_view(data_nvfbc);
+		return;
+	}
+
+	data_nvfbc->needs_rebuild = true;
+}
+
+/* Must be called with the session mutex held. */
+static void update_follow(data_t *data)
+{
+	if (!uses_follow_box(&data->settings))
+	{
+		return;
+	}
+
+#if !defined(_WIN32) || !_WIN32
+	if (data->settings.screen == SCREEN_WINDOW)
+	{
+		update_follow_window(data);
+	}
+	else if (data->settings.screen == SCREEN_CURSOR)
+	{
+		update_follow_cursor(data);
+	}
+#endif
+
+	apply_follow_box(&data->nvfbc);
+}
+
+/* Must be called with the session mutex held and the NvFBC context bound. */
+static void rebuild_capture_session_if_needed(data_t *data)
+{
+	long scale_step = os_atomic_load_long(&data->scale.target_step);
+	if (!data->nvfbc.needs_rebuild && scale_step == data->nvfbc.scale_step)
+	{
+		return;
+	}
+	data->nvfbc.needs_rebuild = false;
+	data->nvfbc.scale_step = scale_step;
+
+	destroy_capture_session(&data->nvfbc);
+	create_capture_session(&data->nvfbc, &data->settings);
+	sched_reset(&data->sched, &data->settings, false);
+}
+
+/* Must be called with the session mutex held. */
+static void calib_set_model(data_t *data, bool push_model)
+{
+	if (data->nvfbc.push_model != push_model)
+	{
+		data->nvfbc.push_model = push_model;
+		data->nvfbc.needs_rebuild = true;
+	}
+}
+
+/* Must be called with the session mutex held. Measures one capture model at a time, the
+	capture session gets rebuilt with the other model on the next grab. */
+static void calib_start(data_t *data, bool rebuild)
+{
+	data_calib_t *calib = &data->calib;
+
+	if (!data->settings.auto_model)
+	{
+		calib->state = CALIB_DONE;
+		data->nvfbc.push_model = data->settings.push_model;
+		return;
+	}
+
+	memset(calib->stats, 0, sizeof(calib->stats));
+	calib->state = CALIB_PULL;
+	calib->state_end_ns = 0;
+	if (rebuild)
+	{
+		calib_set_model(data, false);
+	}
+	else
+	{
+		data->nvfbc.push_model = false;
+	}
+}
+
+/* How old the shown frame is on average, plus a whole OBS frame for every frame NvFBC dropped. */
+static double calib_score_ms(const model_stats_t *stats)
+{
+	double interval_ms = get_obs_frame_interval_ns() / 1000000.0;
+	double age_ms = stats->age_sum_ns / 1000000.0 / stats->frames;
+
+	return age_ms + interval_ms * stats->missed / stats->grabs;
+}
+
+static void calib_commit(data_t *data)
+{
+	data_calib_t *calib = &data->calib;
+	model_stats_t *pull = &calib->stats[0];
+	model_stats_t *push = &calib->stats[1];
+	bool push_model = data->settings.push_model;
+
+	/* A still desktop gives push mode next to no frames, there is nothing to compare then. */
+	if (pull->frames < CALIB_MIN_FRAMES || push->frames < CALIB_MIN_FRAMES)
+	{
+		blog(LOG_INFO, "NvFBC source '%s': too few new frames to compare capture models (pull %u, push %u), keeping the %s model",
+			obs_source_get_name(data->obs.source), pull->frames, push->frames, push_model ? "push" : "pull");
+	}
+	else
+	{
+		double pull_score = calib_score_ms(pull);
+		double push_score = calib_score_ms(push);
+		push_model = push_score <= pull_score;
+
+		blog(LOG_INFO, "NvFBC source '%s': pull model %.2f ms (%llu missed), push model %.2f ms (%llu missed), using the %s model",
+			obs_source_get_name(data->obs.source), pull_score, (unsigned long long)pull->missed,
+			push_score, (unsigned long long)push->missed, push_model ? "push" : "pull");
+	}
+
+	calib->state = CALIB_DONE;
+	calib_set_model(data, push_model);
+}
+
+/* Must be called with the session mutex held. */
+static void calib_update(data_t *data, const NVFBC_FRAME_GRAB_INFO *info, uint64_t grab_ns, uint64_t frame_ns)
+{
+	data_calib_t *calib = &data->calib;
+
+	if (calib->state == CALIB_DONE)
+	{
+		/* A different output mode may favour the other model. */
+		if (data->settings.auto_model && (info->dwWidth != calib->width || info->dwHeight != calib->height))
+		{
+			calib->width = info->dwWidth;
+			calib->height = info->dwHeight;
+			calib_start(data, true);
+		}
+		return;
+	}
+
+	if (calib->state_end_ns == 0)
+	{
+		calib->state_end_ns = grab_ns + CALIB_WINDOW_NS;
+	}
+
+	model_stats_t *stats = &calib->stats[calib->state == CALIB_PUSH];
+	++stats->grabs;
+	stats->missed += info->dwMissedFrames;
+	/* Frame ages are only known once NvFBC's clock is mapped onto ours. */
+	if (info->bIsNewFrame && data->sched.clock.valid)
+	{
+		++stats->frames;
+		stats->age_sum_ns += grab_ns - frame_ns;
+	}
+
+	if (grab_ns < calib->state_end_ns)
+	{
+		return;
+	}
+
+	calib->width = info->dwWidth;
+	calib->height = info->dwHeight;
+
+	if (calib->state == CALIB_PULL)
+	{
+		calib->state = CALIB_PUSH;
+		calib->state_end_ns = 0;
+		calib_set_model(data, true);
+		return;
+	}
+
+	calib_commit(data);
+}
+
+static void direct_report(data_t *data)
+{
+	direct_counters_t *total = &data->direct.total;
+
+	if (total->frames == 0)
+	{
+		return;
+	}
+
+	blog(LOG_INFO, "NvFBC source '%s': direct capture on %u of %u frames (%.1f%%), %u of them post-processed, %u attach/detach switches",
+		obs_source_get_name(data->obs.source), total->direct, total->frames, 100.0 * total->direct / total->frames,
+		total->post_processed, total->switches);
+
+	memset(total, 0, sizeof(*total));
+}
+
+static void direct_reset(data_direct_t *direct)
+{
+	memset(&direct->window, 0, sizeof(direct->window));
+	direct->last_direct = false;
+	direct->fallen_back = false;
+}
+
+/* Must be called with the session mutex held. Direct capture only pays off if the frames
+	really bypass post-processing and NvFBC does not keep attaching and detaching. */
+static void direct_update(data_t *data, const NVFBC_FRAME_GRAB_INFO *info)
+{
+	data_direct_t *direct = &data->direct;
+
+	if (!data->settings.direct_capture || !info->bIsNewFrame)
+	{
+		return;
+	}
+
+	bool is_direct = info->bDirectCapture == NVFBC_TRUE;
+	direct_counters_t *counters[] = {&direct->total, &direct->window};
+	for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+	{
+		++counters[i]->frames;
+		counters[i]->direct += is_direct;
+		counters[i]->post_processed += is_direct && info->bRequiredPostProcessing == NVFBC_TRUE;
+		counters[i]->switches += is_direct != direct->last_direct;
+	}
+	direct->last_direct = is_direct;
+
+	if (direct->window.frames < DIRECT_WINDOW_FRAMES)
+	{
+		return;
+	}
+
+	const char *reason = NULL;
+	if (direct->window.direct > 0 && direct->window.post_processed * 2 > direct->window.direct)
+	{
+		reason = "most direct frames required post-processing";
+	}
+	else if (direct->window.switches > DIRECT_MAX_SWITCHES)
+	{
+		reason = "it kept attaching and detaching";
+	}
+	memset(&direct->window, 0, sizeof(direct->window));
+
+	if (reason == NULL)
+	{
+		return;
+	}
+
+	blog(LOG_WARNING, "NvFBC source '%s': disabling direct capture, %s", obs_source_get_name(data->obs.source), reason);
+	direct_report(data);
+
+	/* Stays off until the settings change or the source is shown again. */
+	direct->fallen_back = true;
+	data->settings.direct_capture = false;
+	data->nvfbc.needs_rebuild = true;
+}
+
+static void telemetry_add(int64_t *counter, int64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void telemetry_set(int64_t *counter, int64_t n)
+{
+	__atomic_store_n(counter, n, __ATOMIC_RELAXED);
+}
+
+static int64_t telemetry_load(const int64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static uint32_t telemetry_bucket(uint64_t us)
+{
+	if (us < 4)
+	{
+		return us;
+	}
+
+	uint32_t msb = 2;
+	while (us >> (msb + 1) != 0)
+	{
+		msb++;
+	}
+
+	uint32_t bucket = 4 * (msb - 1) + ((us >> (msb - 2)) & 3);
+	return bucket < TELEMETRY_HIST_BUCKETS ? bucket : TELEMETRY_HIST_BUCKETS - 1;
+}
+
+/* Upper bound of a bucket in microseconds. */
+static uint64_t telemetry_bucket_limit(uint32_t bucket)
+{
+	if (bucket < 4)
+	{
+		return bucket + 1;
+	}
+
+	uint32_t msb = bucket / 4 + 1;
+	return (uint64_t)(5 + bucket % 4) << (msb - 2);
+}
+
+static void telemetry_hist_add(telemetry_hist_t *hist, uint64_t ns)
+{
+	telemetry_add(&hist->buckets[telemetry_bucket(ns / 1000)], 1);
+}
+
+static uint64_t telemetry_hist_percentile(const telemetry_hist_t *hist, uint32_t percent)
+{
+	int64_t counts[TELEMETRY_HIST_BUCKETS];
+	int64_t count = 0;
+	for (uint32_t i = 0; i < TELEMETRY_HIST_BUCKETS; i++)
+	{
+		counts[i] = telemetry_load(&hist->buckets[i]);
+		count += counts[i];
+	}
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	int64_t target = (count * percent + 99) / 100;
+	int64_t sum = 0;
+	for (uint32_t i = 0; i < TELEMETRY_HIST_BUCKETS; i++)
+	{
+		sum += counts[i];
+		if (sum >= target)
+		{
+			return telemetry_bucket_limit(i);
+		}
+	}
+
+	return telemetry_bucket_limit(TELEMETRY_HIST_BUCKETS - 1);
+}
+
+/* Must be called with the session mutex held right after every successful grab. */
+static void telemetry_grab(data_t *data, const NVFBC_FRAME_GRAB_INFO *info, uint64_t grab_time_ns)
+{
+	data_telemetry_t *telemetry = &data->telemetry;
+
+	telemetry_add(&telemetry->grabs, 1);
+	telemetry_add(info->bIsNewFrame ? &telemetry->new_frames : &telemetry->duplicate_grabs, 1);
+	telemetry_add(&telemetry->missed_frames, info->dwMissedFrames);
+	telemetry_set(&telemetry->current_frame, info->dwCurrentFrame);
+	telemetry_hist_add(&telemetry->grab_hist, grab_time_ns);
+}
+
+/* Adds the results the GPU has finished, oldest first. */
+static void gpu_timer_collect(gpu_timer_t *timer, telemetry_hist_t *hist)
+{
+	while (timer->pending != 0)
+	{
+		GLuint query = timer->queries[(timer->next + GPU_TIMER_QUERIES - timer->pending) % GPU_TIMER_QUERIES];
+
+		GLint available = GL_FALSE;
+		glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+		{
+			break;
+		}
+
+		GLuint64 elapsed_ns = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed_ns);
+		telemetry_hist_add(hist, elapsed_ns);
+		timer->resolved++;
+		timer->resolved_sum_ns += elapsed_ns;
+		timer->pending--;
+	}
+}
+
+/* Returns how many results were read back since the last call and their sum. */
+static uint32_t gpu_timer_take(gpu_timer_t *timer, uint64_t *sum_ns)
+{
+	uint32_t resolved = timer->resolved;
+	*sum_ns = timer->resolved_sum_ns;
+	timer->resolved = 0;
+	timer->resolved_sum_ns = 0;
+	return resolved;
+}
+
+/* Must be called within the OBS graphics context. Skips the measurement if all queries are
+	still in flight. */
+static void gpu_timer_begin(gpu_timer_t *timer, telemetry_hist_t *hist)
+{
+	if (timer->queries[0] == 0)
+	{
+		glGenQueries(GPU_TIMER_QUERIES, timer->queries);
+	}
+
+	gpu_timer_collect(timer, hist);
+	if (timer->pending == GPU_TIMER_QUERIES)
+	{
+		return;
+	}
+
+	glBeginQuery(GL_TIME_ELAPSED, timer->queries[timer->next]);
+	timer->running = true;
+}
+
+static void gpu_timer_end(gpu_timer_t *timer)
+{
+	if (!timer->running)
+	{
+		return;
+	}
+
+	glEndQuery(GL_TIME_ELAPSED);
+	timer->next = (timer->next + 1) % GPU_TIMER_QUERIES;
+	timer->pending++;
+	timer->running = false;
+}
+
+/* Must be called within the OBS graphics context. */
+static void gpu_timer_destroy(gpu_timer_t *timer)
+{
+	if (timer->queries[0] != 0)
+	{
+		glDeleteQueries(GPU_TIMER_QUERIES, timer->queries);
+	}
+	memset(timer, 0, sizeof(*timer));
+}
+
+static void telemetry_report_stage(const char *name, const char *stage, const telemetry_hist_t *cpu_hist, const telemetry_hist_t *gpu_hist)
+{
+	blog(LOG_INFO, "NvFBC source '%s': %s p50/p99 %llu/%llu us on the CPU, %llu/%llu us on the GPU", name, stage,
+		(unsigned long long)telemetry_hist_percentile(cpu_hist, 50), (unsigned long long)telemetry_hist_percentile(cpu_hist, 99),
+		(unsigned long long)telemetry_hist_percentile(gpu_hist, 50), (unsigned long long)telemetry_hist_percentile(gpu_hist, 99));
+}
+
+static void telemetry_report(data_t *data)
+{
+	data_telemetry_t *telemetry = &data->telemetry;
+
+	if (telemetry_load(&telemetry->copies) == 0)
+	{
+		return;
+	}
+
+	const char *name = obs_source_get_name(data->obs.source);
+	telemetry_report_stage(name, "copy", &telemetry->copy_hist, &telemetry->gpu_copy_hist);
+	telemetry_report_stage(name, "post-process", &telemetry->post_hist, &telemetry->gpu_post_hist);
+	telemetry_report_stage(name, "draw", &telemetry->draw_hist, &telemetry->gpu_draw_hist);
+}
+
+/* Proc handler: "void get_stats(out int grabs, ...)", counters since the source was created. */
+static void get_stats_proc(void *p, calldata_t *cd)
+{
+	data_t *data = p;
+	data_telemetry_t *telemetry = &data->telemetry;
+
+	calldata_set_int(cd, "grabs", telemetry_load(&telemetry->grabs));
+	calldata_set_int(cd, "new_frames", telemetry_load(&telemetry->new_frames));
+	calldata_set_int(cd, "missed_frames", telemetry_load(&telemetry->missed_frames));
+	calldata_set_int(cd, "duplicate_grabs", telemetry_load(&telemetry->duplicate_grabs));
+	calldata_set_int(cd, "current_frame", telemetry_load(&telemetry->current_frame));
+	calldata_set_int(cd, "copies", telemetry_load(&telemetry->copies));
+	calldata_set_int(cd, "copy_bytes", telemetry_load(&telemetry->copy_bytes));
+}
+
+static void set_percentiles(calldata_t *cd, const char *p50_name, const char *p99_name, const telemetry_hist_t *hist)
+{
+	calldata_set_int(cd, p50_name, telemetry_hist_percentile(hist, 50));
+	calldata_set_int(cd, p99_name, telemetry_hist_percentile(hist, 99));
+}
+
+/* Proc handler: "void get_cpu_times(out int grab_p50_us, ...)", times in microseconds. */
+static void get_cpu_times_proc(void *p, calldata_t *cd)
+{
+	data_t *data = p;
+	data_telemetry_t *telemetry = &data->telemetry;
+
+	set_percentiles(cd, "grab_p50_us", "grab_p99_us", &telemetry->grab_hist);
+	set_percentiles(cd, "copy_p50_us", "copy_p99_us", &telemetry->copy_hist);
+	set_percentiles(cd, "post_p50_us", "post_p99_us", &telemetry->post_hist);
+	set_percentiles(cd, "draw_p50_us", "draw_p99_us", &telemetry->draw_hist);
+}
+
+/* Proc handler: "void get_gpu_times(out int copy_p50_us, ...)", times in microseconds. */
+static void get_gpu_times_proc(void *p, calldata_t *cd)
+{
+	data_t *data = p;
+	data_telemetry_t *telemetry = &data->telemetry;
+
+	set_percentiles(cd, "copy_p50_us", "copy_p99_us", &telemetry->gpu_copy_hist);
+	set_percentiles(cd, "post_p50_us", "post_p99_us", &telemetry->gpu_post_hist);
+	set_percentiles(cd, "draw_p50_us", "draw_p99_us", &telemetry->gpu_draw_hist);
+}
+
+/* Must be called with the session mutex held after every successful grab. */
+static void account_grab(data_t *data, const NVFBC_FRAME_GRAB_INFO *info, uint64_t grab_ns, uint64_t frame_ns)
+{
+	calib_update(data, info, grab_ns, frame_ns);
+	direct_update(data, info);
+}
+
+#if !defined(_WIN32) || !_WIN32
+static void reset_desktop_transition(data_t *data)
+{
+	data->x11.visible_transition = (data->settings.fps + 5) / -6;
+}
+
+/* Wait a few frames to make sure the old desktop is never visible. */
+static bool is_desktop_transition_done(data_t *data, const NVFBC_FRAME_GRAB_INFO *info)
+{
+	if (data->x11.visible_transition + 1 < 0)
+	{
+		if (info->bIsNewFrame == NVFBC_TRUE)
+		{
+			++data->x11.visible_transition;
+		}
+		return false;
+	}
+	if (data->x11.visible_transition + 1 == 0)
+	{
+		if (info->bIsNewFrame == NVFBC_FALSE)
+		{
+			return false;
+		}
+		++data->x11.visible_transition;
+	}
+
+	/* Need to check again to avoid a "race condition". */
+	if (!is_desktop_visible(data))
+	{
+		reset_desktop_transition(data);
+		return false;
+	}
+
+	return true;
+}
+#endif
+
+static void scale_set_step(data_t *data, long step, uint64_t copy_avg_ns, uint64_t budget_ns)
+{
+	blog(LOG_INFO, "NvFBC: copies took %.2f ms of GPU time on average against a budget of %.2f ms, capturing at %u%% from now on",
+		copy_avg_ns / 1000000.0, budget_ns / 1000000.0, scale_percents[step]);
+
+	os_atomic_set_long(&data->scale.target_step, step);
+	data->scale.over_windows = 0;
+	data->scale.under_windows = 0;
+}
+
+/* Must be called with the texture mutex held. Steps the capture size down when copies keep
+	going over budget and back up once the larger size would fit comfortably. Copies are
+	asynchronous, so they are judged by the GPU time the copy timer resolved, which lags a few frames. */
+static void scale_update(data_t *data, long scale_step, uint32_t copies, uint64_t copy_sum_ns)
+{
+	data_scale_t *scale = &data->scale;
+
+	scale->copy_sum_ns += copy_sum_ns;
+	scale->frames += copies;
+	if (scale->frames < SCALE_WINDOW_FRAMES)
+	{
+		return;
+	}
+
+	uint64_t copy_avg_ns = scale->copy_sum_ns / scale->frames;
+	scale->frames = 0;
+	scale->copy_sum_ns = 0;
+
+	uint64_t budget_ns = get_obs_frame_interval_ns() / SCALE_BUDGET_DIVIDER;
+	long step = os_atomic_load_long(&scale->target_step);
+	if (budget_ns == 0 || step != scale_step)
+	{
+		return;
+	}
+
+	if (copy_avg_ns > budget_ns)
+	{
+		scale->under_windows = 0;
+		if (step + 1 < (long)(sizeof(scale_percents) / sizeof(scale_percents[0])) && ++scale->over_windows >= SCALE_DOWN_WINDOWS)
+		{
+			scale_set_step(data, step + 1, copy_avg_ns, budget_ns);
+		}
+		return;
+	}
+
+	scale->over_windows = 0;
+	if (step == 0)
+	{
+		return;
+	}
+
+	/* Copy time grows with the pixel count, leave a quarter of the budget as headroom. */
+	double ratio = (double)scale_percents[step - 1] / scale_percents[step];
+	if (copy_avg_ns * ratio * ratio < budget_ns * 0.75)
+	{
+		if (++scale->under_windows >= SCALE_UP_WINDOWS)
+		{
+			scale_set_step(data, step - 1, copy_avg_ns, budget_ns);
+		}
+	}
+	else
+	{
+		scale->under_windows = 0;
+	}
+}
+
+static void scale_reset(data_scale_t *scale)
+{
+	os_atomic_set_long(&scale->target_step, 0);
+	scale->frames = 0;
+	scale->copy_sum_ns = 0;
+	scale->over_windows = 0;
+	scale->under_windows = 0;
+}
+
+static bool uses_post_process(const data_settings_t *settings)
+{
+	return settings->crop_left != 0 || settings->crop_top != 0 || settings->crop_right != 0 || settings->crop_bottom != 0 ||
+		settings->mask_count != 0 || settings->has_color_matrix;
+}
+
+/* Must be called within the OBS graphics context with the texture mutex held. Crops, masks and
+	colour converts a new frame in a single pass, so every view just draws the result. */
+static void post_process(data_t *data)
+{
+	data_post_t *post = &data->post;
+	const data_settings_t *settings = &data->settings;
+	const data_texture_t *tex = &data->tex;
+
+	post->ready = false;
+
+	if (post_effect == NULL || tex->display_width == 0 || tex->display_height == 0 ||
+		(uint32_t)(settings->crop_left + settings->crop_right) >= tex->display_width ||
+		(uint32_t)(settings->crop_top + settings->crop_bottom) >= tex->display_height)
+	{
+		return;
+	}
+
+	if (post->texrender == NULL)
+	{
+		post->texrender = gs_texrender_create(GS_RGBA, GS_ZS_NONE);
+		if (post->texrender == NULL)
+		{
+			return;
+		}
+	}
+
+	uint32_t width = tex->display_width - settings->crop_left - settings->crop_right;
+	uint32_t height = tex->display_height - settings->crop_top - settings->crop_bottom;
+
+	/* Crop and masks are given in shown pixels, the texture may be captured smaller. */
+	float scale_x = tex->view.w != 0 ? 1.0f : (float)tex->width / tex->display_width;
+	float scale_y = tex->view.h != 0 ? 1.0f : (float)tex->height / tex->display_height;
+
+	struct vec4 crop;
+	vec4_set(&crop, (tex->view.x + settings->crop_left * scale_x) / tex->width, (tex->view.y + settings->crop_top * scale_y) / tex->height,
+		width * scale_x / tex->width, height * scale_y / tex->height);
+
+	struct vec2 texel;
+	vec2_set(&texel, 1.0f / tex->width, 1.0f / tex->height);
+
+	struct vec4 masks[POST_MAX_MASKS] = {0};
+	float blur[POST_MAX_MASKS] = {0.0f};
+	for (uint32_t i = 0; i < settings->mask_count; i++)
+	{
+		const post_mask_t *mask = &settings->masks[i];
+		vec4_set(&masks[i], (float)mask->x / width, (float)mask->y / height, (float)(mask->x + mask->w) / width, (float)(mask->y + mask->h) / height);
+		blur[i] = mask->blur * scale_x;
+	}
+
+	struct vec4 mask_blur;
+	vec4_set(&mask_blur, blur[0], blur[1], blur[2], blur[3]);
+
+	/* Row vectors, so every output channel is a column of the matrix. */
+	struct matrix4 color_matrix;
+	matrix4_identity(&color_matrix);
+	if (settings->has_color_matrix)
+	{
+		const float *m = settings->color_matrix;
+		vec4_set(&color_matrix.x, m[0], m[4], m[8], 0.0f);
+		vec4_set(&color_matrix.y, m[1], m[5], m[9], 0.0f);
+		vec4_set(&color_matrix.z, m[2], m[6], m[10], 0.0f);
+		vec4_set(&color_matrix.t, m[3], m[7], m[11], 1.0f);
+	}
+
+	gs_texrender_reset(post->texrender);
+	if (!gs_texrender_begin(post->texrender, width, height))
+	{
+		return;
+	}
+
+	struct vec4 clear_color;
+	vec4_zero(&clear_color);
+	gs_clear(GS_CLEAR_COLOR, &clear_color, 0.0f, 0);
+	gs_ortho(0.0f, (float)width, 0.0f, (float)height, -100.0f, 100.0f);
+
+	gs_blend_state_push();
+	gs_enable_blending(false);
+
+	gs_effect_set_texture(gs_effect_get_param_by_name(post_effect, "image"), tex->texture);
+	gs_effect_set_vec4(gs_effect_get_param_by_name(post_effect, "crop"), &crop);
+	gs_effect_set_vec2(gs_effect_get_param_by_name(post_effect, "texel"), &texel);
+	gs_effect_set_int(gs_effect_get_param_by_name(post_effect, "mask_count"), settings->mask_count);
+	gs_effect_set_vec4(gs_effect_get_param_by_name(post_effect, "mask0"), &masks[0]);
+	gs_effect_set_vec4(gs_effect_get_param_by_name(post_effect, "mask1"), &masks[1]);
+	gs_effect_set_vec4(gs_effect_get_param_by_name(post_effect, "mask2"), &masks[2]);
+	gs_effect_set_vec4(gs_effect_get_param_by_name(post_effect, "mask3"), &masks[3]);
+	gs_effect_set_vec4(gs_effect_get_param_by_name(post_effect, "mask_blur"), &mask_blur);
+	gs_effect_set_matrix4(gs_effect_get_param_by_name(post_effect, "color_matrix"), &color_matrix);
+
+	while (gs_effect_loop(post_effect, "Draw"))
+	{
+		gs_draw_sprite(tex->texture, 0, width, height);
+	}
+
+	gs_blend_state_pop();
+	gs_texrender_end(post->texrender);
+
+	post->width = width;
+	post->height = height;
+	post->ready = true;
+}
+
+/* Must be called with the session mutex held. */
+static void get_frame_layout(const data_nvfbc_t *data_nvfbc, frame_layout_t *layout)
+{
+	layout->tracked_box = data_nvfbc->tracked_box;
+	layout->view = data_nvfbc->view;
+	layout->scale_step = data_nvfbc->scale_step;
+	layout->stitch_count = data_nvfbc->stitch_count;
+	memcpy(layout->stitch_tiles, data_nvfbc->stitch_tiles, sizeof(layout->stitch_tiles));
+	layout->stitch_width = data_nvfbc->stitch_width;
+	layout->stitch_height = data_nvfbc->stitch_height;
+	layout->tex_target = data_nvfbc->togl_setup_params.dwTexTarget;
+}
+
+static bool copy_image(data_t *data, const frame_layout_t *layout, GLuint nvfbc_tex, uint32_t src_x, uint32_t src_y, uint32_t dst_x, uint32_t dst_y, uint32_t width, uint32_t height)
+{
+#if _WIN32
+	p_wglCopyImageSubDataNV(
+#else
+	p_glXCopyImageSubDataNV(
+		data->x11.dpy,
+#endif
+		data->nvfbc.nvfbc_ctx, nvfbc_tex, layout->tex_target, 0, src_x, src_y, 0,
+		NULL, *(GLuint *)gs_texture_get_obj(data->tex.texture), GL_TEXTURE_2D, 0, dst_x, dst_y, 0,
+		width, height, 1);
+
+	GLenum glerr = glGetError();
+	if (glerr != GL_NO_ERROR)
+	{
+#if _WIN32
+		blog(LOG_ERROR, "wglCopyImageSubDataNV GL error: %x", glerr);
+#else
+		blog(LOG_ERROR, "glXCopyImageSubDataNV GL error: %x", glerr);
+#endif
+		return false;
+	}
+
+	telemetry_add(&data->telemetry.copy_bytes, (int64_t)width * height * 4);
+
+	return true;
+}
+
+/* Copies each output's box, the space between outputs on the X screen is never touched. */
+static bool copy_stitched(data_t *data, const frame_layout_t *layout, GLuint nvfbc_tex, const NVFBC_FRAME_GRAB_INFO *info)
+{
+	for (uint32_t i = 0; i < layout->stitch_count; i++)
+	{
+		const stitch_tile_t *tile = &layout->stitch_tiles[i];
+		if (tile->src.x >= info->dwWidth || tile->src.y >= info->dwHeight)
+		{
+			continue;
+		}
+
+		uint32_t width = tile->src.w < info->dwWidth - tile->src.x ? tile->src.w : info->dwWidth - tile->src.x;
+		uint32_t height = tile->src.h < info->dwHeight - tile->src.y ? tile->src.h : info->dwHeight - tile->src.y;
+		if (!copy_image(data, layout, nvfbc_tex, tile->src.x, tile->src.y, tile->x, tile->y, width, height))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool copy_to_texture(data_t *data, const frame_layout_t *layout, GLuint nvfbc_tex, const NVFBC_FRAME_GRAB_INFO *info)
+{
+	stage_start(profile_texture_lock_name);
+	int error = pthread_mutex_lock(&data->tex.texture_mutex);
+	stage_end(profile_texture_lock_name);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Mutex lock error: %s", strerror(error));
+		goto tex_lock_err;
+	}
+
+	bool stitched = layout->stitch_count != 0;
+	uint32_t width = stitched ? layout->stitch_width : info->dwWidth;
+	uint32_t height = stitched ? layout->stitch_height : info->dwHeight;
+
+	if (need_texture_resize(&data->tex, width, height))
+	{
+		stage_start(profile_resize_name);
+		bool resized = resize_texture(&data->tex, width, height);
+		stage_end(profile_resize_name);
+		if (!resized)
+		{
+			goto tex_create_failed;
+		}
+
+		/* Gaps in a stitch layout are never copied to. */
+		if (stitched)
+		{
+			clear_texture(&data->tex);
+		}
+	}
+	else if (!info->bIsNewFrame)
+	{
+		goto omit_tex_copy;
+	}
+
+	data->tex.layout = *layout;
+
+	/* Scaled down captures are still shown at the size of the captured region. */
+	data->tex.view = (NVFBC_BOX){0};
+	if (stitched)
+	{
+		data->tex.display_width = width;
+		data->tex.display_height = height;
+	}
+	else if (uses_follow_box(&data->settings))
+	{
+		/* NvFBC may have rounded the capture box down. */
+		NVFBC_BOX view = layout->view;
+		view.w = view.x + view.w > width ? (view.x < width ? width - view.x : 0) : view.w;
+		view.h = view.y + view.h > height ? (view.y < height ? height - view.y : 0) : view.h;
+		if (view.w == 0 || view.h == 0)
+		{
+			view = (NVFBC_BOX){0, 0, width, height};
+		}
+
+		data->tex.view = view;
+		data->tex.display_width = view.w;
+		data->tex.display_height = view.h;
+	}
+	else if (layout->scale_step != 0)
+	{
+		data->tex.display_width = layout->tracked_box.w;
+		data->tex.display_height = layout->tracked_box.h;
+	}
+	else
+	{
+		data->tex.display_width = info->dwWidth;
+		data->tex.display_height = info->dwHeight;
+	}
+
+	uint64_t copy_start_ns = os_gettime_ns();
+
+	stage_start(profile_copy_name);
+	gpu_timer_begin(&data->gpu.copy, &data->telemetry.gpu_copy_hist);
+	bool copied = stitched ? copy_stitched(data, layout, nvfbc_tex, info) : copy_image(data, layout, nvfbc_tex, 0, 0, 0, 0, info->dwWidth, info->dwHeight);
+	gpu_timer_end(&data->gpu.copy);
+	stage_end(profile_copy_name);
+	if (!copied)
+	{
+		goto tex_copy_failed;
+	}
+
+	uint64_t gpu_copy_sum_ns;
+	uint32_t gpu_copies = gpu_timer_take(&data->gpu.copy, &gpu_copy_sum_ns);
+
+	uint64_t copy_ns = os_gettime_ns() - copy_start_ns;
+	telemetry_add(&data->telemetry.copies, 1);
+	telemetry_hist_add(&data->telemetry.copy_hist, copy_ns);
+
+	if (data->settings.adaptive_resolution && !stitched && !uses_follow_box(&data->settings))
+	{
+		scale_update(data, layout->scale_step, gpu_copies, gpu_copy_sum_ns);
+	}
+
+	if (data->settings.mipmaps)
+	{
+		stage_start(profile_mipmaps_name);
+		update_mipmaps(&data->tex);
+		stage_end(profile_mipmaps_name);
+	}
+
+	if (uses_post_process(&data->settings))
+	{
+		stage_start(profile_post_process_name);
+		uint64_t post_start_ns = os_gettime_ns();
+		gpu_timer_begin(&data->gpu.post, &data->telemetry.gpu_post_hist);
+		post_process(data);
+		gpu_timer_end(&data->gpu.post);
+		telemetry_hist_add(&data->telemetry.post_hist, os_gettime_ns() - post_start_ns);
+		stage_end(profile_post_process_name);
+	}
+
+	if (!data->obs.has_first_frame)
+	{
+		data->obs.has_first_frame = true;
+		blog(LOG_INFO, "NvFBC: First frame %.1f ms after the source was created", (os_gettime_ns() - data->obs.create_ns) / 1000000.0);
+	}
+
+omit_tex_copy:;
+	error = pthread_mutex_unlock(&data->tex.texture_mutex);
+	assert(error == 0);
+	return true;
+
+tex_copy_failed:;
+tex_create_failed:;
+	error = pthread_mutex_unlock(&data->tex.texture_mutex);
+	assert(error == 0);
+tex_lock_err:;
+	return false;
+}
+
+#if !defined(_WIN32) || !_WIN32
+static void probe_report(data_t *data)
+{
+	data_probe_t *probe = &data->probe;
+
+	pthread_mutex_lock(&probe->mutex);
+	if (probe->markers != 0)
+	{
+		blog(LOG_INFO, "NvFBC source '%s': latency probe saw %u of %u markers, marker-to-grab p50 < %u ms, p99 < %u ms, max %.1f ms, marker-to-render p50 < %u ms, p99 < %u ms, max %.1f ms",
+			obs_source_get_name(data->obs.source), probe->detected, probe->markers,
+			latency_hist_percentile(&probe->grab_hist, 50), latency_hist_percentile(&probe->grab_hist, 99),
+			probe->grab_hist.max_ns / 1000000.0,
+			latency_hist_percentile(&probe->render_hist, 50), latency_hist_percentile(&probe->render_hist, 99),
+			probe->render_hist.max_ns / 1000000.0);
+	}
+
+	memset(&probe->grab_hist, 0, sizeof(probe->grab_hist));
+	memset(&probe->render_hist, 0, sizeof(probe->render_hist));
+	probe->markers = 0;
+	probe->detected = 0;
+	probe->report_ns = os_gettime_ns();
+	pthread_mutex_unlock(&probe->mutex);
+}
+
+/* The top-left corner of what is grabbed, on the X screen. */
+static void get_probe_position(const frame_layout_t *layout, long *x, long *y)
+{
+	const NVFBC_BOX *box = layout->stitch_count != 0 ? &layout->stitch_tiles[0].src : &layout->tracked_box;
+
+	*x = box->x;
+	*y = box->y;
+}
+
+/* Matches a sampled pixel against the marker state. Frames grabbed before the last flip can not
+	match it, the marker has the other colour since. */
+static void probe_evaluate(data_t *data, const uint8_t *pixel, uint64_t grab_ns, uint64_t render_ns)
+{
+	data_probe_t *probe = &data->probe;
+
+	bool white = pixel[0] > 192 && pixel[1] > 192 && pixel[2] > 192;
+	bool black = pixel[0] < 64 && pixel[1] < 64 && pixel[2] < 64;
+
+	pthread_mutex_lock(&probe->mutex);
+	if ((white || black) && probe->marker_ns != 0 && grab_ns >= probe->marker_ns && !probe->seen && white == probe->white)
+	{
+		probe->seen = true;
+		probe->detected++;
+		latency_hist_add(&probe->grab_hist, grab_ns - probe->marker_ns);
+		if (render_ns != 0)
+		{
+			latency_hist_add(&probe->render_hist, render_ns > probe->marker_ns ? render_ns - probe->marker_ns : 0);
+		}
+	}
+	bool report = os_gettime_ns() - probe->report_ns >= PROBE_REPORT_INTERVAL_NS;
+	pthread_mutex_unlock(&probe->mutex);
+
+	if (report)
+	{
+		probe_report(data);
+	}
+}
+
+/* Must be called within the OBS graphics context. Evaluates the readbacks the GPU has finished,
+	oldest first. */
+static void probe_collect(data_t *data)
+{
+	data_probe_t *probe = &data->probe;
+
+	while (probe->readback_pending != 0)
+	{
+		probe_readback_t *readback = &probe->readbacks[(probe->readback_next + PROBE_READBACKS - probe->readback_pending) % PROBE_READBACKS];
+
+		GLenum status = glClientWaitSync(readback->fence, 0, 0);
+		if (status == GL_TIMEOUT_EXPIRED)
+		{
+			break;
+		}
+		glDeleteSync(readback->fence);
+		readback->fence = NULL;
+		probe->readback_pending--;
+
+		if (status == GL_WAIT_FAILED)
+		{
+			continue;
+		}
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer);
+		const uint8_t *pixel = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 4, GL_MAP_READ_BIT);
+		if (pixel != NULL)
+		{
+			uint8_t copy[4];
+			memcpy(copy, pixel, sizeof(copy));
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			probe_evaluate(data, copy, readback->grab_ns, readback->render_ns);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+}
+
+/* Must be called within the OBS graphics context. */
+static void probe_destroy_readbacks(data_probe_t *probe)
+{
+	for (uint32_t i = 0; i < PROBE_READBACKS; i++)
+	{
+		probe_readback_t *readback = &probe->readbacks[i];
+		if (readback->fence != NULL)
+		{
+			glDeleteSync(readback->fence);
+		}
+		if (readback->buffer != 0)
+		{
+			glDeleteBuffers(1, &readback->buffer);
+		}
+	}
+	memset(probe->readbacks, 0, sizeof(probe->readbacks));
+	probe->readback_next = 0;
+	probe->readback_pending = 0;
+}
+
+/* Must be called within the OBS graphics context right after a new frame was copied. The sample is
+	read back through a pixel buffer and evaluated on a later frame, once the GPU is done with it. */
+static void probe_detect(data_t *data, const frame_layout_t *layout, GLuint nvfbc_tex, const NVFBC_FRAME_GRAB_INFO *info, uint64_t grab_ns)
+{
+	data_probe_t *probe = &data->probe;
+
+	probe_collect(data);
+
+	long x, y;
+	get_probe_position(layout, &x, &y);
+	os_atomic_set_long(&probe->x, x);
+	os_atomic_set_long(&probe->y, y);
+
+	uint32_t sample_x = PROBE_SAMPLE_OFFSET, sample_y = PROBE_SAMPLE_OFFSET;
+	if (layout->stitch_count != 0)
+	{
+		sample_x += x;
+		sample_y += y;
+	}
+	else
+	{
+		sample_x = sample_x * scale_percents[layout->scale_step] / 100;
+		sample_y = sample_y * scale_percents[layout->scale_step] / 100;
+	}
+	if (sample_x >= info->dwWidth || sample_y >= info->dwHeight)
+	{
+		return;
+	}
+
+	if (probe->readback_pending == PROBE_READBACKS)
+	{
+		return;
+	}
+
+	if (probe->texture == 0)
+	{
+		glGenTextures(1, &probe->texture);
+		glBindTexture(GL_TEXTURE_2D, probe->texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	probe_readback_t *readback = &probe->readbacks[probe->readback_next];
+	if (readback->buffer == 0)
+	{
+		glGenBuffers(1, &readback->buffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER, 4, NULL, GL_STREAM_READ);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	p_glXCopyImageSubDataNV(data->x11.dpy,
+		data->nvfbc.nvfbc_ctx, nvfbc_tex, layout->tex_target, 0, sample_x, sample_y, 0,
+		NULL, probe->texture, GL_TEXTURE_2D, 0, 0, 0, 0,
+		1, 1, 1);
+
+	/* Into the buffer, so nothing waits for the GPU here. */
+	glBindTexture(GL_TEXTURE_2D, probe->texture);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	GLenum glerr = glGetError();
+	if (glerr != GL_NO_ERROR)
+	{
+		blog(LOG_ERROR, "Latency probe readback GL error: %x", glerr);
+		return;
+	}
+
+	readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	readback->grab_ns = grab_ns;
+	readback->render_ns = 0;
+	probe->readback_next = (probe->readback_next + 1) % PROBE_READBACKS;
+	probe->readback_pending++;
+}
+
+/* Must be called from render() after the frame was drawn. The first draw of the last sampled frame
+	counts as when it was shown. */
+static void probe_rendered(data_t *data)
+{
+	data_probe_t *probe = &data->probe;
+
+	if (probe->readback_pending == 0)
+	{
+		return;
+	}
+
+	probe_readback_t *readback = &probe->readbacks[(probe->readback_next + PROBE_READBACKS - 1) % PROBE_READBACKS];
+	if (readback->render_ns == 0)
+	{
+		readback->render_ns = os_gettime_ns();
+	}
+}
+
+static void *probe_thread(void *p)
+{
+	data_t *data = p;
+	data_probe_t *probe = &data->probe;
+
+	os_set_thread_name("nvfbc-probe");
+	trace_set_thread_name("nvfbc-probe");
+
+	Display *dpy = XOpenDisplay(NULL);
+	if (dpy == NULL)
+	{
+		blog(LOG_ERROR, "%s", "Could not open X11 display for the latency probe");
+		return NULL;
+	}
+
+	int screen = DefaultScreen(dpy);
+	long x = os_atomic_load_long(&probe->x);
+	long y = os_atomic_load_long(&probe->y);
+
+	XSetWindowAttributes attributes = {0};
+	attributes.override_redirect = True;
+	attributes.background_pixel = BlackPixel(dpy, screen);
+	Window window = XCreateWindow(dpy, RootWindow(dpy, screen), x, y, PROBE_MARKER_SIZE, PROBE_MARKER_SIZE, 0,
+		CopyFromParent, InputOutput, CopyFromParent, CWOverrideRedirect | CWBackPixel, &attributes);
+	XMapRaised(dpy, window);
+	XSync(dpy, False);
+
+	/* The jitter keeps the markers from locking onto the OBS frame tick. */
+	bool white = false;
+	unsigned int seed = (unsigned int)os_gettime_ns();
+	while (os_event_timedwait(probe->stop_event, PROBE_INTERVAL_MS + rand_r(&seed) % PROBE_JITTER_MS) == ETIMEDOUT)
+	{
+		long new_x = os_atomic_load_long(&probe->x);
+		long new_y = os_atomic_load_long(&probe->y);
+		if (new_x != x || new_y != y)
+		{
+			x = new_x;
+			y = new_y;
+			XMoveWindow(dpy, window, x, y);
+		}
+
+		white = !white;
+		XSetWindowBackground(dpy, window, white ? WhitePixel(dpy, screen) : BlackPixel(dpy, screen));
+		XClearWindow(dpy, window);
+		XRaiseWindow(dpy, window);
+		XSync(dpy, False);
+
+		uint64_t now = os_gettime_ns();
+		pthread_mutex_lock(&probe->mutex);
+		probe->markers++;
+		probe->white = white;
+		probe->seen = false;
+		probe->marker_ns = now;
+		pthread_mutex_unlock(&probe->mutex);
+	}
+
+	XDestroyWindow(dpy, window);
+	XCloseDisplay(dpy);
+
+	return NULL;
+}
+
+/* Must be called with the session mutex held, so the marker starts out where the session grabs. */
+static bool start_probe_thread(data_t *data)
+{
+	data_probe_t *probe = &data->probe;
+
+	if (probe->has_thread)
+	{
+		return true;
+	}
+
+	frame_layout_t layout;
+	get_frame_layout(&data->nvfbc, &layout);
+	long x, y;
+	get_probe_position(&layout, &x, &y);
+	os_atomic_set_long(&probe->x, x);
+	os_atomic_set_long(&probe->y, y);
+
+	pthread_mutex_lock(&probe->mutex);
+	probe->markers = 0;
+	probe->detected = 0;
+	probe->seen = false;
+	probe->marker_ns = 0;
+	probe->report_ns = os_gettime_ns();
+	memset(&probe->grab_hist, 0, sizeof(probe->grab_hist));
+	memset(&probe->render_hist, 0, sizeof(probe->render_hist));
+	pthread_mutex_unlock(&probe->mutex);
+	os_event_reset(probe->stop_event);
+
+	int error = pthread_create(&probe->thread, NULL, probe_thread, data);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Thread creation error: %s", strerror(error));
+		return false;
+	}
+
+	probe->has_thread = true;
+
+	return true;
+}
+
+static void stop_probe_thread(data_t *data)
+{
+	data_probe_t *probe = &data->probe;
+
+	if (!probe->has_thread)
+	{
+		return;
+	}
+
+	os_event_signal(probe->stop_event);
+	pthread_join(probe->thread, NULL);
+	probe->has_thread = false;
+
+	probe_report(data);
+}
+#endif
+
+/* Takes over the frame the capture thread grabbed last, if any. */
+static bool update_texture_from_thread(data_t *data)
+{
+	data_capture_t *capture = &data->capture;
+	bool ret = true;
+
+	stage_start(profile_frame_lock_name);
+	int error = pthread_mutex_lock(&capture->frame_mutex);
+	stage_end(profile_frame_lock_name);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Mutex lock error: %s", strerror(error));
+		return false;
+	}
+
+	if (!capture->ready)
+	{
+		goto no_frame;
+	}
+
+#if !defined(_WIN32) || !_WIN32
+	stage_start(profile_desktop_check_name);
+	bool desktop_visible = is_desktop_visible(data);
+	stage_end(profile_desktop_check_name);
+	if (!desktop_visible)
+	{
+		reset_desktop_transition(data);
+		goto frame_consumed;
+	}
+	if (!is_desktop_transition_done(data, &capture->info))
+	{
+		goto frame_consumed;
+	}
+#endif
+
+	pthread_mutex_lock(&data->nvfbc.session_mutex);
+	sched_update(data, &capture->info, capture->frame_ns);
+	pthread_mutex_unlock(&data->nvfbc.session_mutex);
+
+	ret = copy_to_texture(data, &capture->layout, capture->texture, &capture->info);
+	if (ret)
+	{
+		bench_add_source_frame(data);
+	}
+#if !defined(_WIN32) || !_WIN32
+	if (ret && data->probe.has_thread)
+	{
+		stage_start(profile_probe_name);
+		probe_detect(data, &capture->layout, capture->texture, &capture->info, capture->grab_ns);
+		stage_end(profile_probe_name);
+	}
+#endif
+	/* The capture thread grabs into the same NvFBC texture next. NvFBC's context is not in OBS's
+		share group, so there is no sync object both could use. */
+	glFlush();
+
+#if !defined(_WIN32) || !_WIN32
+frame_consumed:;
+#endif
+	capture->ready = false;
+	os_event_signal(capture->wake);
+no_frame:;
+	error = pthread_mutex_unlock(&capture->frame_mutex);
+	assert(error == 0);
+	return ret;
+}
+
+/* Grabs without the OBS graphics context. On success the session mutex stays locked until
+	publish_frame() has copied the frame. */
+static bool grab_frame(data_t *data)
+{
+	stage_start(profile_session_lock_name);
+	int error = pthread_mutex_lock(&data->nvfbc.session_mutex);
+	stage_end(profile_session_lock_name);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Mutex lock error: %s", strerror(error));
+		goto nvfbc_lock_err;
+	}
+
+	if (!data->nvfbc.has_capture_session)
+	{
+		goto no_capture_session;
+	}
+
+#if !defined(_WIN32) || !_WIN32
+	/* Check desktop here to avoid capturing the desktop if not necessary. */
+	stage_start(profile_desktop_check_name);
+	bool desktop_visible = is_desktop_visible(data);
+	stage_end(profile_desktop_check_name);
+	if (!desktop_visible)
+	{
+		reset_desktop_transition(data);
+		goto desktop_hidden;
+	}
+#endif
+
+	stage_start(profile_enter_context_name);
+	bool entered = enter_nvfbc_context(&data->nvfbc);
+	stage_end(profile_enter_context_name);
+	if (!entered)
+	{
+		goto enter_ctx_failed;
+	}
+
+	stage_start(profile_update_session_name);
+	update_follow(data);
+	rebuild_capture_session_if_needed(data);
+	stage_end(profile_update_session_name);
+
+	/* A fresh session has nothing to compare against, don't wait for the screen to change. */
+	uint32_t flags = NVFBC_TOGL_GRAB_FLAGS_NOWAIT | (data->nvfbc.force_refresh ? NVFBC_TOGL_GRAB_FLAGS_FORCE_REFRESH : 0);
+	uint64_t grab_start_ns = os_gettime_ns();
+	stage_start(profile_grab_name);
+	bool grabbed = capture_frame(&data->nvfbc, flags, 0, &data->batch.texture, &data->batch.info);
+	stage_end(profile_grab_name);
+	if (!grabbed)
+	{
+		goto capture_frame_err;
+	}
+	data->nvfbc.force_refresh = false;
+	data->batch.grab_ns = os_gettime_ns();
+	data->batch.frame_ns = timestamp_frame(data, &data->batch.info, data->batch.grab_ns);
+	telemetry_grab(data, &data->batch.info, data->batch.grab_ns - grab_start_ns);
+	bench_add_grab(data, data->batch.grab_ns - grab_start_ns);
+
+	leave_nvfbc_context(&data->nvfbc);
+
+	return true;
+
+capture_frame_err:;
+	leave_nvfbc_context(&data->nvfbc);
+enter_ctx_failed:;
+#if !defined(_WIN32) || !_WIN32
+desktop_hidden:;
+#endif
+no_capture_session:;
+	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
+	assert(error == 0);
+nvfbc_lock_err:;
+	return false;
+}
+
+/* Must be called within the OBS graphics context after a successful grab_frame(). */
+static bool publish_frame(data_t *data)
+{
+	NVFBC_FRAME_GRAB_INFO *info = &data->batch.info;
+	bool ret = true;
+
+	sched_update(data, info, data->batch.frame_ns);
+	account_grab(data, info, data->batch.grab_ns, data->batch.frame_ns);
+
+#if !defined(_WIN32) || !_WIN32
+	if (!is_desktop_transition_done(data, info))
+	{
+		goto desktop_hidden;
+	}
+#endif
+
+	frame_layout_t layout;
+	get_frame_layout(&data->nvfbc, &layout);
+	ret = copy_to_texture(data, &layout, data->batch.texture, info);
+	if (ret && info->bIsNewFrame)
+	{
+		bench_add_source_frame(data);
+	}
+
+#if !defined(_WIN32) || !_WIN32
+	if (ret && info->bIsNewFrame && data->probe.has_thread)
+	{
+		stage_start(profile_probe_name);
+		probe_detect(data, &layout, data->batch.texture, info, data->batch.grab_ns);
+		stage_end(profile_probe_name);
+	}
+
+desktop_hidden:;
+#endif
+	int error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
+	assert(error == 0);
+
+	return ret;
+}
+
+/* Time left until the next OBS frame is due, at least 1 ms since 0 would disable the timeout. */
+static uint32_t get_deadline_timeout_ms(uint64_t interval_ns)
+{
+	uint64_t now = os_gettime_ns();
+	uint64_t deadline = obs_get_video_frame_time() + interval_ns;
+
+	if (deadline < now + CAPTURE_DEADLINE_MARGIN_NS)
+	{
+		deadline += (now + CAPTURE_DEADLINE_MARGIN_NS - deadline) / interval_ns * interval_ns + interval_ns;
+	}
+
+	uint32_t timeout_ms = (deadline - now) / 1000000;
+	return timeout_ms > 0 ? timeout_ms : 1;
+}
+
+static void *capture_thread(void *p)
+{
+	data_t *data = p;
+	data_capture_t *capture = &data->capture;
+
+	os_set_thread_name("nvfbc-capture");
+	trace_set_thread_name("nvfbc-capture");
+#if !defined(_WIN32) || !_WIN32
+	apply_thread_policy(&data->settings, "capture");
+#endif
+
+	uint64_t interval_ns = get_obs_frame_interval_ns();
+	if (interval_ns == 0)
+	{
+		interval_ns = 1000000000ULL / data->settings.fps;
+	}
+	profile_register_root(profile_capture_thread_name, interval_ns);
+
+	while (!capture->stop)
+	{
+		/* Never grab over a frame OBS has not copied yet. */
+		pthread_mutex_lock(&capture->frame_mutex);
+		bool pending = capture->ready;
+		pthread_mutex_unlock(&capture->frame_mutex);
+		if (pending || bench_pauses(data))
+		{
+			os_event_timedwait(capture->wake, CAPTURE_IDLE_WAIT_MS);
+			continue;
+		}
+
+		/* Without the low-latency deadline, just wait for the next frame and let OBS pick it up. */
+		uint32_t timeout_ms = data->settings.low_latency ? get_deadline_timeout_ms(interval_ns) : CAPTURE_IDLE_WAIT_MS;
+
+		stage_start(profile_capture_thread_name);
+
+		stage_start(profile_session_lock_name);
+		pthread_mutex_lock(&data->nvfbc.session_mutex);
+		stage_end(profile_session_lock_name);
+
+		stage_start(profile_enter_context_name);
+		bool entered = data->nvfbc.has_capture_session && enter_nvfbc_context(&data->nvfbc);
+		stage_end(profile_enter_context_name);
+		if (!entered)
+		{
+			pthread_mutex_unlock(&data->nvfbc.session_mutex);
+			stage_end(profile_capture_thread_name);
+			os_event_timedwait(capture->wake, CAPTURE_IDLE_WAIT_MS);
+			continue;
+		}
+
+		stage_start(profile_update_session_name);
+		update_follow(data);
+		rebuild_capture_session_if_needed(data);
+		stage_end(profile_update_session_name);
+
+		GLuint nvfbc_tex;
+		NVFBC_FRAME_GRAB_INFO info;
+		uint64_t grab_ns = 0, frame_ns = 0;
+		uint32_t flags = NVFBC_TOGL_GRAB_FLAGS_NOWAIT_IF_NEW_FRAME_READY | (data->nvfbc.force_refresh ? NVFBC_TOGL_GRAB_FLAGS_FORCE_REFRESH : 0);
+		uint32_t session_id = data->nvfbc.session_id;
+		frame_layout_t layout;
+		get_frame_layout(&data->nvfbc, &layout);
+
+		/* Wait for the frame without the session mutex, so neither the UI nor the phase-lock
+			thread stall behind it. */
+		pthread_mutex_lock(&data->nvfbc.grab_mutex);
+		pthread_mutex_unlock(&data->nvfbc.session_mutex);
+
+		uint64_t grab_start_ns = os_gettime_ns();
+		stage_start(profile_grab_name);
+		bool grabbed = capture_frame(&data->nvfbc, flags, timeout_ms, &nvfbc_tex, &info);
+		stage_end(profile_grab_name);
+		leave_nvfbc_context(&data->nvfbc);
+		pthread_mutex_unlock(&data->nvfbc.grab_mutex);
+
+		pthread_mutex_lock(&data->nvfbc.session_mutex);
+		/* The session was rebuilt meanwhile, its texture is gone. */
+		if (grabbed && session_id != data->nvfbc.session_id)
+		{
+			grabbed = false;
+		}
+		if (grabbed)
+		{
+			data->nvfbc.force_refresh = false;
+			grab_ns = os_gettime_ns();
+			frame_ns = timestamp_frame(data, &info, grab_ns);
+			telemetry_grab(data, &info, grab_ns - grab_start_ns);
+			account_grab(data, &info, grab_ns, frame_ns);
+		}
+		pthread_mutex_unlock(&data->nvfbc.session_mutex);
+		stage_end(profile_capture_thread_name);
+
+		if (!grabbed)
+		{
+			os_event_timedwait(capture->wake, CAPTURE_IDLE_WAIT_MS);
+			continue;
+		}
+
+		/* Timed out, OBS keeps showing the previous frame. */
+		if (!info.bIsNewFrame)
+		{
+			continue;
+		}
+
+		pthread_mutex_lock(&capture->frame_mutex);
+		capture->texture = nvfbc_tex;
+		capture->info = info;
+		capture->layout = layout;
+		capture->grab_ns = grab_ns;
+		capture->frame_ns = frame_ns;
+		capture->ready = true;
+		pthread_mutex_unlock(&capture->frame_mutex);
+	}
+
+	return NULL;
+}
+
+static bool start_capture_thread(data_t *data)
+{
+	data_capture_t *capture = &data->capture;
+
+	if (capture->has_thread)
+	{
+		return true;
+	}
+
+	capture->stop = false;
+	capture->ready = false;
+	os_event_reset(capture->wake);
+
+	int error = pthread_create(&capture->thread, NULL, capture_thread, data);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Thread creation error: %s", strerror(error));
+		return false;
+	}
+
+	capture->has_thread = true;
+
+	return true;
+}
+
+/* Must not be called with the session mutex held, the capture thread needs it to finish its grab. */
+static void stop_capture_thread(data_t *data)
+{
+	data_capture_t *capture = &data->capture;
+
+	if (!capture->has_thread)
+	{
+		return;
+	}
+
+	capture->stop = true;
+	os_event_signal(capture->wake);
+	pthread_join(capture->thread, NULL);
+
+	pthread_mutex_lock(&capture->frame_mutex);
+	capture->ready = false;
+	capture->has_thread = false;
+	pthread_mutex_unlock(&capture->frame_mutex);
+}
+
+#if !defined(_WIN32) || !_WIN32
+static bool open_cursor_display(data_cursor_t *cursor)
+{
+	if (cursor->dpy != NULL)
+	{
+		return true;
+	}
+
+	cursor->dpy = XOpenDisplay(NULL);
+	if (cursor->dpy == NULL)
+	{
+		blog(LOG_ERROR, "%s", "Could not open X11 display for cursor tracking");
+		return false;
+	}
+
+	int event_base, error_base;
+	if (!XFixesQueryExtension(cursor->dpy, &event_base, &error_base))
+	{
+		blog(LOG_ERROR, "%s", "XFixes extension not available");
+		XCloseDisplay(cursor->dpy);
+		cursor->dpy = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/* Must be called within the OBS graphics context. */
+static void close_cursor_display(data_cursor_t *cursor)
+{
+	if (cursor->texture != NULL)
+	{
+		gs_texture_destroy(cursor->texture);
+		cursor->texture = NULL;
+	}
+
+	if (cursor->dpy != NULL)
+	{
+		XCloseDisplay(cursor->dpy);
+		cursor->dpy = NULL;
+	}
+
+	cursor->serial = 0;
+	cursor->visible = false;
+}
+
+/* Must be called within the OBS graphics context. The image is only uploaded when it changed. */
+static void update_cursor(data_cursor_t *cursor)
+{
+	XFixesCursorImage *image = XFixesGetCursorImage(cursor->dpy);
+	if (image == NULL)
+	{
+		cursor->visible = false;
+		return;
+	}
+
+	cursor->x = image->x - image->xhot;
+	cursor->y = image->y - image->yhot;
+	cursor->visible = image->width > 0 && image->height > 0;
+
+	if (cursor->visible && (cursor->texture == NULL || image->cursor_serial != cursor->serial))
+	{
+		/* XFixes hands out 32 bit pixels in longs. */
+		uint32_t *pixels = bmalloc(image->width * image->height * sizeof(uint32_t));
+		for (size_t i = 0; i < (size_t)image->width * image->height; i++)
+		{
+			pixels[i] = (uint32_t)image->pixels[i];
+		}
+
+		if (cursor->texture != NULL && (cursor->width != image->width || cursor->height != image->height))
+		{
+			gs_texture_destroy(cursor->texture);
+			cursor->texture = NULL;
+		}
+
+		if (cursor->texture == NULL)
+		{
+			const uint8_t *data = (const uint8_t *)pixels;
+			cursor->texture = gs_texture_create(image->width, image->height, GS_BGRA, 1, &data, GS_DYNAMIC);
+		}
+		else
+		{
+			gs_texture_set_image(cursor->texture, (const uint8_t *)pixels, image->width * sizeof(uint32_t), false);
+		}
+
+		bfree(pixels);
+
+		cursor->width = image->width;
+		cursor->height = image->height;
+		cursor->serial = image->cursor_serial;
+	}
+
+	XFree(image);
+}
+
+/* Draws the cursor as a sprite clipped to the captured region. */
+static void render_cursor(data_t *data, bool post_processed)
+{
+	data_cursor_t *cursor = &data->cursor;
+
+	if (!cursor->visible || cursor->texture == NULL)
+	{
+		return;
+	}
+
+	/* Clip to the captured area, or to the output the cursor is on in a stitched capture. The
+		layout is the one of the frame in the texture, not of the session the next grab uses. */
+	const frame_layout_t *layout = &data->tex.layout;
+	int x = cursor->x - (int)layout->tracked_box.x - (int)data->tex.view.x;
+	int y = cursor->y - (int)layout->tracked_box.y - (int)data->tex.view.y;
+	int clip_x = 0, clip_y = 0;
+	int clip_w = data->tex.display_width, clip_h = data->tex.display_height;
+
+	if (layout->stitch_count != 0)
+	{
+		const stitch_tile_t *tile = NULL;
+		for (uint32_t i = 0; i < layout->stitch_count && tile == NULL; i++)
+		{
+			const NVFBC_BOX *src = &layout->stitch_tiles[i].src;
+			if (cursor->x >= (int)src->x && cursor->x < (int)(src->x + src->w) && cursor->y >= (int)src->y && cursor->y < (int)(src->y + src->h))
+			{
+				tile = &layout->stitch_tiles[i];
+			}
+		}
+
+		if (tile == NULL)
+		{
+			return;
+		}
+
+		x = cursor->x - (int)tile->src.x + (int)tile->x;
+		y = cursor->y - (int)tile->src.y + (int)tile->y;
+		clip_x = tile->x;
+		clip_y = tile->y;
+		clip_w = tile->src.w;
+		clip_h = tile->src.h;
+	}
+
+	/* The post-processed frame starts at the crop and ends at its size. */
+	if (post_processed)
+	{
+		x -= data->settings.crop_left;
+		y -= data->settings.crop_top;
+		clip_x -= data->settings.crop_left;
+		clip_y -= data->settings.crop_top;
+		clip_w = clip_x + clip_w < (int)data->post.width ? clip_w : (int)data->post.width - clip_x;
+		clip_h = clip_y + clip_h < (int)data->post.height ? clip_h : (int)data->post.height - clip_y;
+		clip_w -= clip_x < 0 ? -clip_x : 0;
+		clip_h -= clip_y < 0 ? -clip_y : 0;
+		clip_x = clip_x < 0 ? 0 : clip_x;
+		clip_y = clip_y < 0 ? 0 : clip_y;
+	}
+
+	int left = x < clip_x ? clip_x - x : 0;
+	int top = y < clip_y ? clip_y - y : 0;
+	int right = clip_x + clip_w - x < (int)cursor->width ? clip_x + clip_w - x : (int)cursor->width;
+	int bottom = clip_y + clip_h - y < (int)cursor->height ? clip_y + clip_h - y : (int)cursor->height;
+	if (right <= left || bottom <= top)
+	{
+		return;
+	}
+
+	gs_effect_t *effect = obs_get_base_effect(OBS_EFFECT_DEFAULT);
+	gs_eparam_t *image = gs_effect_get_param_by_name(effect, "image");
+	if (image == NULL)
+	{
+		blog(LOG_ERROR, "Effect image parameter not found");
+		return;
+	}
+
+	/* XFixes cursor images are premultiplied. */
+	gs_enable_blending(true);
+	gs_blend_function(GS_BLEND_ONE, GS_BLEND_INVSRCALPHA);
+
+	gs_matrix_push();
+	gs_matrix_translate3f((float)(x + left), (float)(y + top), 0.0f);
+	gs_effect_set_texture(image, cursor->texture);
+
+	while (gs_effect_loop(effect, "Draw"))
+	{
+		gs_draw_sprite_subregion(cursor->texture, 0, left, top, right - left, bottom - top);
+	}
+
+	gs_matrix_pop();
+}
+#endif
+
+static int get_capture_state(data_t *data)
+{
+	if (!data->obs.showing)
+	{
+		return CAPTURE_PAUSED;
+	}
+
+	if (data->obs.active || data->settings.capture_policy == CAPTURE_POLICY_ALWAYS)
+	{
+		return CAPTURE_FULL;
+	}
+
+	return data->settings.capture_policy == CAPTURE_POLICY_REDUCED ? CAPTURE_REDUCED : CAPTURE_PAUSED;
+}
+
+/* Masks are "x,y,w,h" entries separated by semicolons, with an optional ",blur" radius. */
+static uint32_t parse_masks(const char *list, post_mask_t *masks)
+{
+	uint32_t count = 0;
+
+	while (*list != '\0' && count < POST_MAX_MASKS)
+	{
+		unsigned int x, y, w, h;
+		float blur = 0.0f;
+		int fields = sscanf(list, " %u , %u , %u , %u , %f", &x, &y, &w, &h, &blur);
+		if (fields >= 4 && w != 0 && h != 0)
+		{
+			masks[count++] = (post_mask_t){x, y, w, h, fields == 5 ? blur : 0.0f};
+		}
+		else
+		{
+			blog(LOG_WARNING, "NvFBC: Ignoring mask \"%.*s\"", (int)strcspn(list, ";"), list);
+		}
+
+		const char *end = strchr(list, ';');
+		list = end != NULL ? end + 1 : list + strlen(list);
+	}
+
+	return count;
+}
+
+/* Twelve numbers, one row of red, green, blue and offset per output channel. */
+static bool parse_color_matrix(const char *text, float *matrix)
+{
+	const char *p = text;
+	for (int i = 0; i < 12; i++)
+	{
+		while (*p == ' ' || *p == ',' || *p == ';' || *p == '\n')
+		{
+			p++;
+		}
+
+		char *end;
+		matrix[i] = strtof(p, &end);
+		if (end == p)
+		{
+			if (*text != '\0')
+			{
+				blog(LOG_WARNING, "NvFBC: Ignoring colour matrix \"%s\", it needs 12 numbers", text);
+			}
+			return false;
+		}
+		p = end;
+	}
+
+	return true;
+}
+
+static void copy_settings(data_settings_t *settings, obs_data_t *obs_settings)
+{
+	settings->screen = obs_data_get_int(obs_settings, "screen");
+	snprintf(settings->stitch_layout, sizeof(settings->stitch_layout), "%s", obs_data_get_string(obs_settings, "stitch_layout"));
+	settings->show_cursor = obs_data_get_bool(obs_settings, "show_cursor");
+	settings->fps = obs_data_get_int(obs_settings, "fps");
+	settings->push_model = obs_data_get_bool(obs_settings, "push_model");
+	settings->auto_model = obs_data_get_bool(obs_settings, "auto_model");
+	settings->direct_capture = obs_data_get_bool(obs_settings, "direct_capture");
+	settings->adaptive_resolution = obs_data_get_bool(obs_settings, "adaptive_resolution");
+	settings->mipmaps = obs_data_get_bool(obs_settings, "mipmaps");
+	settings->phase_lock = obs_data_get_bool(obs_settings, "phase_lock");
+	settings->low_latency = obs_data_get_bool(obs_settings, "low_latency");
+	settings->threaded = obs_data_get_bool(obs_settings, "threaded");
+	settings->capture_policy = obs_data_get_int(obs_settings, "capture_policy");
+	settings->reduced_divider = obs_data_get_int(obs_settings, "reduced_divider");
+	settings->crop_left = obs_data_get_int(obs_settings, "crop_left");
+	settings->crop_top = obs_data_get_int(obs_settings, "crop_top");
+	settings->crop_right = obs_data_get_int(obs_settings, "crop_right");
+	settings->crop_bottom = obs_data_get_int(obs_settings, "crop_bottom");
+	settings->mask_count = parse_masks(obs_data_get_string(obs_settings, "masks"), settings->masks);
+	settings->has_color_matrix = parse_color_matrix(obs_data_get_string(obs_settings, "color_matrix"), settings->color_matrix);
+#if !defined(_WIN32) || !_WIN32
+	settings->desktop = obs_data_get_int(obs_settings, "desktop");
+	settings->window = obs_data_get_int(obs_settings, "window");
+	settings->zoom_width = obs_data_get_int(obs_settings, "zoom_width");
+	settings->zoom_height = obs_data_get_int(obs_settings, "zoom_height");
+	settings->cursor_overlay = obs_data_get_bool(obs_settings, "cursor_overlay");
+	settings->latency_probe = obs_data_get_bool(obs_settings, "latency_probe");
+	settings->thread_priority = obs_data_get_int(obs_settings, "thread_priority");
+	settings->timer_slack_us = obs_data_get_int(obs_settings, "timer_slack_us");
+
+	const char *cpus = obs_data_get_string(obs_settings, "cpu_affinity");
+	settings->has_affinity = cpus != NULL && *cpus != '\0' && parse_cpu_list(cpus, &settings->affinity);
+	if (cpus != NULL && *cpus != '\0' && !settings->has_affinity)
+	{
+		blog(LOG_WARNING, "NvFBC: Ignoring invalid CPU list \"%s\"", cpus);
+	}
+#endif
+}
+
+/* Must be called with the session mutex held. */
+static void start_capture_session(data_t *data)
+{
+	if (!enter_nvfbc_context(&data->nvfbc))
+	{
+		return;
+	}
+
+	if (data->direct.fallen_back)
+	{
+		data->settings.direct_capture = true;
+	}
+	direct_reset(&data->direct);
+	calib_start(data, false);
+	data->nvfbc.scale_step = os_atomic_load_long(&data->scale.target_step);
+	update_follow(data);
+	create_capture_session(&data->nvfbc, &data->settings);
+	leave_nvfbc_context(&data->nvfbc);
+	sched_reset(&data->sched, &data->settings, false);
+}
+
+static void coordinator_add(data_t *data)
+{
+	data->batch.weak_source = obs_source_get_weak_source(data->obs.source);
+	data->batch.bench_slot = -1;
+
+	pthread_mutex_lock(&coordinator_mutex);
+	data->batch.next = coordinator_sources;
+	coordinator_sources = data;
+	pthread_mutex_unlock(&coordinator_mutex);
+}
+
+static void coordinator_remove(data_t *data)
+{
+	pthread_mutex_lock(&coordinator_mutex);
+	for (data_t **it = &coordinator_sources; *it != NULL; it = &(*it)->batch.next)
+	{
+		if (*it == data)
+		{
+			*it = data->batch.next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&coordinator_mutex);
+
+	obs_weak_source_release(data->batch.weak_source);
+	data->batch.weak_source = NULL;
+}
+
+/* The caller must hold a reference on the source, so what is returned stays alive. */
+static data_t *coordinator_find(obs_source_t *source)
+{
+	data_t *data;
+
+	pthread_mutex_lock(&coordinator_mutex);
+	for (data = coordinator_sources; data != NULL && data->obs.source != source; data = data->batch.next)
+		;
+	pthread_mutex_unlock(&coordinator_mutex);
+
+	return data;
+}
+
+static void *create(obs_data_t *settings, obs_source_t *source)
+{
+	obs_enter_graphics();
+	if (gs_get_device_type() != GS_DEVICE_OPENGL)
+	{
+		blog(LOG_ERROR, "%s", "This plugin requires an OpenGL context");
+		goto not_opengl_err;
+	}
+#if !defined(_WIN32) || !_WIN32
+	Display *dpy = glXGetCurrentDisplay();
+#endif
+	obs_leave_graphics();
+#if !defined(_WIN32) || !_WIN32
+#if LIBOBS_API_VER >= MAKE_SEMANTIC_VERSION(27, 0, 0)
+	if (obs_get_nix_platform() != OBS_NIX_PLATFORM_X11_GLX)
+	{
+		blog(LOG_ERROR, "%s", "This plugin requires a GLX context");
+		goto not_glx_err;
+	}
+#endif
+#endif
+
+	data_t *data = bzalloc(sizeof(data_t));
+	if (data == NULL)
+	{
+		blog(LOG_ERROR, "%s", "Out of memory");
+		goto alloc_err;
+	}
+
+	data->obs.source = source;
+	data->obs.create_ns = os_gettime_ns();
+	data->obs.showing = obs_source_showing(source);
+	data->obs.active = obs_source_active(source);
+	copy_settings(&data->settings, settings);
+	data->nvfbc.nvfbc_session = -1;
+#if !defined(_WIN32) || !_WIN32
+	data->x11.dpy = dpy;
+#endif
+
+	int error = pthread_mutex_init(&data->nvfbc.session_mutex, NULL);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Mutex initialization error: %s", strerror(error));
+		goto sess_mutex_err;
+	}
+
+	error = pthread_mutex_init(&data->nvfbc.grab_mutex, NULL);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Mutex initialization error: %s", strerror(error));
+		goto grab_mutex_err;
+	}
+
+	error = pthread_mutex_init(&data->tex.texture_mutex, NULL);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Mutex initialization error: %s", strerror(error));
+		goto tex_mutex_err;
+	}
+
+	error = pthread_mutex_init(&data->capture.frame_mutex, NULL);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Mutex initialization error: %s", strerror(error));
+		goto frame_mutex_err;
+	}
+
+	if (os_event_init(&data->capture.wake, OS_EVENT_TYPE_AUTO) != 0)
+	{
+		blog(LOG_ERROR, "%s", "Event initialization error");
+		goto wake_event_err;
+	}
+
+#if !defined(_WIN32) || !_WIN32
+	error = pthread_mutex_init(&data->probe.mutex, NULL);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Mutex initialization error: %s", strerror(error));
+		goto probe_mutex_err;
+	}
+
+	if (os_event_init(&data->probe.stop_event, OS_EVENT_TYPE_MANUAL) != 0)
+	{
+		blog(LOG_ERROR, "%s", "Event initialization error");
+		goto probe_event_err;
+	}
+#endif
+
+	if (!create_nvfbc_session(&data->nvfbc))
+	{
+		goto nvfbc_err;
+	}
+
+	/* Get a texture of the right size ready before the source is first shown, so it does not report
+		0x0 for the first frames. Only a source that is already shown gets its capture session here,
+		the others get it from show(). Loading a scene collection thus opens no sessions for the
+		sources in scenes nobody looks at. */
+	frame_layout_t layout;
+	pthread_mutex_lock(&data->nvfbc.session_mutex);
+	if (get_capture_state(data) != CAPTURE_PAUSED)
+	{
+		leave_nvfbc_context(&data->nvfbc);
+		start_capture_session(data);
+	}
+	else
+	{
+		update_tracked_box(&data->nvfbc, &data->settings);
+		leave_nvfbc_context(&data->nvfbc);
+	}
+	get_frame_layout(&data->nvfbc, &layout);
+	pthread_mutex_unlock(&data->nvfbc.session_mutex);
+
+	uint32_t width = layout.stitch_count != 0 ? layout.stitch_width : layout.tracked_box.w;
+	uint32_t height = layout.stitch_count != 0 ? layout.stitch_height : layout.tracked_box.h;
+	if (width != 0 && height != 0)
+	{
+		obs_enter_graphics();
+		pthread_mutex_lock(&data->tex.texture_mutex);
+		if (resize_texture(&data->tex, width, height))
+		{
+			data->tex.layout = layout;
+			data->tex.display_width = data->tex.width;
+			data->tex.display_height = data->tex.height;
+		}
+		pthread_mutex_unlock(&data->tex.texture_mutex);
+		obs_leave_graphics();
+	}
+
+	proc_handler_t *procs = obs_source_get_proc_handler(source);
+	proc_handler_add(procs,
+		"void get_stats(out int grabs, out int new_frames, out int missed_frames, out int duplicate_grabs, "
+		"out int current_frame, out int copies, out int copy_bytes)",
+		get_stats_proc, data);
+	proc_handler_add(procs,
+		"void get_cpu_times(out int grab_p50_us, out int grab_p99_us, out int copy_p50_us, out int copy_p99_us, "
+		"out int post_p50_us, out int post_p99_us, out int draw_p50_us, out int draw_p99_us)",
+		get_cpu_times_proc, data);
+	proc_handler_add(procs,
+		"void get_gpu_times(out int copy_p50_us, out int copy_p99_us, out int post_p50_us, out int post_p99_us, "
+		"out int draw_p50_us, out int draw_p99_us)",
+		get_gpu_times_proc, data);
+
+	pthread_mutex_lock(&data->nvfbc.session_mutex);
+#if !defined(_WIN32) || !_WIN32
+	if (data->settings.latency_probe && data->nvfbc.has_capture_session)
+	{
+		start_probe_thread(data);
+	}
+#endif
+	pthread_mutex_unlock(&data->nvfbc.session_mutex);
+
+	coordinator_add(data);
+
+	return data;
+
+nvfbc_err:;
+#if !defined(_WIN32) || !_WIN32
+	os_event_destroy(data->probe.stop_event);
+probe_event_err:;
+	pthread_mutex_destroy(&data->probe.mutex);
+probe_mutex_err:;
+#endif
+	os_event_destroy(data->capture.wake);
+wake_event_err:;
+	pthread_mutex_destroy(&data->capture.frame_mutex);
+frame_mutex_err:;
+	pthread_mutex_destroy(&data->tex.texture_mutex);
+tex_mutex_err:;
+	pthread_mutex_destroy(&data->nvfbc.grab_mutex);
+grab_mutex_err:;
+	pthread_mutex_destroy(&data->nvfbc.session_mutex);
+sess_mutex_err:;
+	bfree(data);
+alloc_err:;
+#if !defined(_WIN32) || !_WIN32
+#if LIBOBS_API_VER >= MAKE_SEMANTIC_VERSION(27, 0, 0)
+not_glx_err:;
+#endif
+#endif
+not_opengl_err:;
+	return NULL;
+}
+
+static void destroy(void *p)
+{
+	data_t *data = p;
+
+	coordinator_remove(data);
+	stop_capture_thread(data);
+	stop_sched_thread(&data->sched);
+	sched_report(data);
+	direct_report(data);
+	telemetry_report(data);
+
+	obs_enter_graphics();
+	gpu_timer_destroy(&data->gpu.copy);
+	gpu_timer_destroy(&data->gpu.post);
+	gpu_timer_destroy(&data->gpu.draw);
+	obs_leave_graphics();
+
+#if !defined(_WIN32) || !_WIN32
+	stop_probe_thread(data);
+
+	obs_enter_graphics();
+	close_cursor_display(&data->cursor);
+	if (data->probe.texture != 0)
+	{
+		glDeleteTextures(1, &data->probe.texture);
+	}
+	probe_destroy_readbacks(&data->probe);
+	obs_leave_graphics();
+	close_window_tracker(&data->window);
+#endif
+
+	pthread_mutex_lock(&data->tex.texture_mutex);
+
+	if (data->tex.texture != NULL)
+	{
+		gs_texture_destroy(data->tex.texture);
+	}
+
+	if (data->post.texrender != NULL)
+	{
+		gs_texrender_destroy(data->post.texrender);
+	}
+
+	pthread_mutex_lock(&data->nvfbc.session_mutex);
+
+	if (data->nvfbc.nvfbc_session != -1)
+	{
+		while (!enter_nvfbc_context(&data->nvfbc))
+			;
+		destroy_capture_session(&data->nvfbc);
+		destroy_nvfbc_session(&data->nvfbc);
+	}
+
+#if !defined(_WIN32) || !_WIN32
+	os_event_destroy(data->probe.stop_event);
+	pthread_mutex_destroy(&data->probe.mutex);
+#endif
+	os_event_destroy(data->capture.wake);
+	pthread_mutex_destroy(&data->capture.frame_mutex);
+	pthread_mutex_destroy(&data->tex.texture_mutex);
+	pthread_mutex_destroy(&data->nvfbc.grab_mutex);
+	pthread_mutex_destroy(&data->nvfbc.session_mutex);
+
+	bfree(data);
+}
+
+static void backpressure_set_level(int level, uint32_t lagged)
+{
+	static const char *const descriptions[] = {
+		"capturing normally again",
+		"holding the last frame of sources not on program",
+		"holding the last frame of sources not on program and grabbing the others every other frame",
+	};
+
+	backpressure.level = level;
+	blog(LOG_INFO, "NvFBC: OBS lagged %u frames in the last second, %s", lagged, descriptions[level]);
+}
+
+/* Looks at the frames OBS lagged in the last second and at how long capturing took on the
+	graphics thread. Shedding goes one level per second, recovery only after a calm period. */
+static void backpressure_update(uint64_t now, uint64_t busy_ns)
+{
+	backpressure.busy_avg_ns = (backpressure.busy_avg_ns * 15 + busy_ns) / 16;
+
+	uint32_t lagged = obs_get_lagged_frames();
+	if (backpressure.window_start_ns == 0)
+	{
+		backpressure.window_start_ns = now;
+		backpressure.window_lagged = lagged;
+		return;
+	}
+
+	if (now - backpressure.window_start_ns < BACKPRESSURE_WINDOW_NS)
+	{
+		return;
+	}
+
+	uint32_t window_lagged = lagged - backpressure.window_lagged;
+	backpressure.window_start_ns = now;
+	backpressure.window_lagged = lagged;
+
+	if (window_lagged >= BACKPRESSURE_LAG_THRESHOLD)
+	{
+		backpressure.calm_windows = 0;
+
+		/* Halving our own rate only helps if capturing is a noticeable part of the frame. */
+		uint64_t interval_ns = get_obs_frame_interval_ns();
+		int max_level = interval_ns != 0 && backpressure.busy_avg_ns * 10 > interval_ns ? BACKPRESSURE_HALF_RATE : BACKPRESSURE_SHED_IDLE;
+		if (backpressure.level < max_level)
+		{
+			backpressure_set_level(backpressure.level + 1, window_lagged);
+		}
+	}
+	else if (window_lagged == 0 && backpressure.level != BACKPRESSURE_NONE && ++backpressure.calm_windows >= BACKPRESSURE_CALM_WINDOWS)
+	{
+		backpressure.calm_windows = 0;
+		backpressure_set_level(backpressure.level - 1, window_lagged);
+	}
+}
+
+/* Skipped sources keep showing their last frame. */
+static bool backpressure_sheds(data_t *data)
+{
+	switch (backpressure.level)
+	{
+	case BACKPRESSURE_SHED_IDLE:
+		return !data->obs.active;
+	case BACKPRESSURE_HALF_RATE:
+		return !data->obs.active || (backpressure.frame_count & 1);
+	default:
+		return false;
+	}
+}
+
+static bool should_capture_this_tick(data_t *data)
+{
+	switch (get_capture_state(data))
+	{
+	case CAPTURE_FULL:
+		return true;
+	case CAPTURE_REDUCED:
+		return data->obs.tick_count++ % data->settings.reduced_divider == 0;
+	default:
+		return false;
+	}
+}
+
+/* Grabs every NvFBC source at once: all sessions are grabbed while the OBS graphics context is
+	released, then it is entered a single time to copy the frames. Threaded sources only need
+	the copy. The coordinator mutex only guards picking the sources, so creating and destroying
+	sources never waits for a grab. */
+static void coordinator_tick(void)
+{
+	pthread_mutex_lock(&coordinator_mutex);
+
+	uint64_t tick_ns = obs_get_video_frame_time();
+	if (tick_ns == coordinator_tick_ns)
+	{
+		pthread_mutex_unlock(&coordinator_mutex);
+		return;
+	}
+	coordinator_tick_ns = tick_ns;
+
+	uint64_t start_ns = os_gettime_ns();
+	uint32_t sources = 0;
+
+	++backpressure.frame_count;
+
+	/* A source being destroyed has no references left and waits for the mutex in
+		coordinator_remove(), it is skipped. The others stay alive until the pass is done. */
+	data_t *pending = NULL;
+	data_t **pending_tail = &pending;
+	for (data_t *data = coordinator_sources; data != NULL; data = data->batch.next)
+	{
+		data->batch.pending = should_capture_this_tick(data) && !backpressure_sheds(data) && !bench_pauses(data);
+		if (!data->batch.pending)
+		{
+			continue;
+		}
+
+		obs_source_t *source = obs_weak_source_get_source(data->batch.weak_source);
+		if (source == NULL)
+		{
+			data->batch.pending = false;
+			continue;
+		}
+
+		data->batch.pending_next = NULL;
+		*pending_tail = data;
+		pending_tail = &data->batch.pending_next;
+	}
+
+	pthread_mutex_unlock(&coordinator_mutex);
+
+	if (pending == NULL)
+	{
+		goto no_pending;
+	}
+
+	trace_set_thread_name("obs-graphics");
+	stage_start(profile_tick_name);
+
+	stage_start(profile_grab_all_name);
+	for (data_t *data = pending; data != NULL; data = data->batch.pending_next)
+	{
+		data->batch.grabbed = !data->capture.has_thread && grab_frame(data);
+	}
+	stage_end(profile_grab_all_name);
+
+	stage_start(profile_enter_graphics_name);
+	obs_enter_graphics();
+	stage_end(profile_enter_graphics_name);
+
+	stage_start(profile_copy_all_name);
+	for (data_t *data = pending; data != NULL; data = data->batch.pending_next)
+	{
+		/* A successful grab_frame() holds the session mutex until publish_frame(), even if a
+			capture thread was started from the UI since. */
+		stage_start(profile_publish_name);
+		if (data->batch.grabbed)
+		{
+			publish_frame(data);
+		}
+		else if (data->capture.has_thread)
+		{
+			update_texture_from_thread(data);
+		}
+		stage_end(profile_publish_name);
+
+#if !defined(_WIN32) || !_WIN32
+		if (data->settings.show_cursor && data->settings.cursor_overlay && open_cursor_display(&data->cursor))
+		{
+			update_cursor(&data->cursor);
+		}
+#endif
+
+		sources += data->nvfbc.has_capture_session;
+	}
+	stage_end(profile_copy_all_name);
+
+	obs_leave_graphics();
+
+	stage_end(profile_tick_name);
+
+	/* Releasing the last reference destroys the source, which takes the coordinator mutex. */
+	for (data_t *data = pending, *next; data != NULL; data = next)
+	{
+		next = data->batch.pending_next;
+		obs_source_release(data->obs.source);
+	}
+
+no_pending:;
+	uint64_t end_ns = os_gettime_ns();
+	bench_add_frame(end_ns - start_ns, sources);
+
+	pthread_mutex_lock(&coordinator_mutex);
+	backpressure_update(end_ns, end_ns - start_ns);
+	pthread_mutex_unlock(&coordinator_mutex);
+}
+
+/* Grabs once per OBS frame, however many views (preview, program, multiview, projectors) draw the source.
+	Whichever source ticks first grabs for all of them. */
+static void video_tick(void *p, float seconds)
+{
+	coordinator_tick();
+}
+
+static void draw(void *p, gs_effect_t *effect)
+{
+	data_t *data = p;
+
+	if (!data->tex.texture)
+	{
+		goto no_texture;
+	}
+
+	effect = obs_get_base_effect(OBS_EFFECT_OPAQUE);
+	gs_blend_state_push();
+	gs_reset_blend_state();
+
+	stage_start(profile_texture_lock_name);
+	int error = pthread_mutex_lock(&data->tex.texture_mutex);
+	stage_end(profile_texture_lock_name);
+	if (error != 0)
+	{
+		blog(LOG_ERROR, "Mutex lock error: %s", strerror(error));
+		goto tex_lock_err;
+	}
+
+	gs_eparam_t *image = gs_effect_get_param_by_name(effect, "image");
+	if (image == NULL)
+	{
+		blog(LOG_ERROR, "Effect image parameter not found");
+		goto no_image;
+	}
+	bool post_processed = data->post.ready && uses_post_process(&data->settings);
+	if (post_processed)
+	{
+		gs_texture_t *texture = gs_texrender_get_texture(data->post.texrender);
+		gs_effect_set_texture(image, texture);
+
+		while (gs_effect_loop(effect, "Draw"))
+		{
+			gs_draw_sprite(texture, 0, data->post.width, data->post.height);
+		}
+
+		goto draw_cursor;
+	}
+
+	if (data->settings.mipmaps)
+	{
+		note_draw_scale(&data->tex);
+	}
+
+	gs_effect_set_texture(image, data->tex.texture);
+
+	while (gs_effect_loop(effect, "Draw"))
+	{
+		if (data->tex.view.w != 0)
+		{
+			gs_draw_sprite_subregion(data->tex.texture, 0, data->tex.view.x, data->tex.view.y, data->tex.view.w, data->tex.view.h);
+		}
+		else
+		{
+			gs_draw_sprite(data->tex.texture, 0, data->tex.display_width, data->tex.display_height);
+		}
+	}
 
+draw_cursor:;
 #if !defined(_WIN32) || !_WIN32
-desktop_hidden:;
-	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
-	assert(error == 0);
-	return true;
+	if (data->settings.show_cursor && data->settings.cursor_overlay)
+	{
+		render_cursor(data, post_processed);
+	}
+
+	probe_rendered(data);
 #endif
 
-tex_copy_failed:;
-tex_create_failed:;
 	error = pthread_mutex_unlock(&data->tex.texture_mutex);
 	assert(error == 0);
-tex_lock_err:;
-	goto enter_ctx_failed;
-capture_frame_err:;
-	switch_to_obs_context(&data->nvfbc);
-enter_ctx_failed:;
-no_capture_session:;
-	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
+
+	gs_blend_state_pop();
+
+	return;
+
+no_image:;
+	error = pthread_mutex_unlock(&data->tex.texture_mutex);
 	assert(error == 0);
-nvfbc_lock_err:;
-	return false;
+tex_lock_err:;
+	gs_blend_state_pop();
+no_texture:;
+	return;
 }
 
-static void copy_settings(data_settings_t *settings, obs_data_t *obs_settings)
+static void render(void *p, gs_effect_t *effect)
 {
-	settings->screen = obs_data_get_int(obs_settings, "screen");
-	settings->show_cursor = obs_data_get_bool(obs_settings, "show_cursor");
-	settings->fps = obs_data_get_int(obs_settings, "fps");
-	settings->push_model = obs_data_get_bool(obs_settings, "push_model");
-	settings->direct_capture = obs_data_get_bool(obs_settings, "direct_capture");
-#if !defined(_WIN32) || !_WIN32
-	settings->desktop = obs_data_get_int(obs_settings, "desktop");
-#endif
+	data_t *data = p;
+
+	stage_start(profile_draw_name);
+	uint64_t draw_start_ns = os_gettime_ns();
+	gpu_timer_begin(&data->gpu.draw, &data->telemetry.gpu_draw_hist);
+	draw(p, effect);
+	gpu_timer_end(&data->gpu.draw);
+	telemetry_hist_add(&data->telemetry.draw_hist, os_gettime_ns() - draw_start_ns);
+	stage_end(profile_draw_name);
 }
 
-static void *create(obs_data_t *settings, obs_source_t *source)
+uint32_t get_width(void *p)
 {
-	obs_enter_graphics();
-	if (gs_get_device_type() != GS_DEVICE_OPENGL)
+	data_t *data = p;
+
+	if (data->post.ready && uses_post_process(&data->settings))
 	{
-		blog(LOG_ERROR, "%s", "This plugin requires an OpenGL context");
-		goto not_opengl_err;
+		return data->post.width;
+	}
+
+	return data->tex.display_width;
+}
+
+uint32_t get_height(void *p)
+{
+	data_t *data = p;
+
+	if (data->post.ready && uses_post_process(&data->settings))
+	{
+		return data->post.height;
+	}
+
+	return data->tex.display_height;
+}
+
+static void get_defaults(obs_data_t *settings)
+{
+	NVFBC_GET_STATUS_PARAMS status_params = {
+		.dwVersion = NVFBC_GET_STATUS_PARAMS_VER};
+
+	if (get_nvfbc_status(-1, &status_params))
+	{
+		obs_data_set_default_int(settings, "screen", status_params.outputs[0].dwId);
 	}
+
+	obs_data_set_default_string(settings, "stitch_layout", "");
+	obs_data_set_default_int(settings, "fps", 60);
+	obs_data_set_default_bool(settings, "show_cursor", true);
+	obs_data_set_default_bool(settings, "push_model", true);
+	obs_data_set_default_bool(settings, "auto_model", false);
+	obs_data_set_default_bool(settings, "direct_capture", false);
+	obs_data_set_default_bool(settings, "adaptive_resolution", false);
+	obs_data_set_default_bool(settings, "mipmaps", false);
+	obs_data_set_default_bool(settings, "phase_lock", false);
+	obs_data_set_default_bool(settings, "low_latency", false);
+	obs_data_set_default_bool(settings, "threaded", false);
+	obs_data_set_default_int(settings, "capture_policy", CAPTURE_POLICY_ALWAYS);
+	obs_data_set_default_int(settings, "reduced_divider", 4);
+	obs_data_set_default_int(settings, "crop_left", 0);
+	obs_data_set_default_int(settings, "crop_top", 0);
+	obs_data_set_default_int(settings, "crop_right", 0);
+	obs_data_set_default_int(settings, "crop_bottom", 0);
+	obs_data_set_default_string(settings, "masks", "");
+	obs_data_set_default_string(settings, "color_matrix", "");
 #if !defined(_WIN32) || !_WIN32
-	Display *dpy = glXGetCurrentDisplay();
+	obs_data_set_default_int(settings, "desktop", -1);
+	obs_data_set_default_int(settings, "window", None);
+	obs_data_set_default_int(settings, "zoom_width", 640);
+	obs_data_set_default_int(settings, "zoom_height", 360);
+	obs_data_set_default_bool(settings, "cursor_overlay", false);
+	obs_data_set_default_bool(settings, "latency_probe", false);
+	obs_data_set_default_int(settings, "thread_priority", THREAD_PRIORITY_NORMAL);
+	obs_data_set_default_string(settings, "cpu_affinity", "");
+	obs_data_set_default_int(settings, "timer_slack_us", 0);
 #endif
-	obs_leave_graphics();
+}
+
 #if !defined(_WIN32) || !_WIN32
-#if LIBOBS_API_VER >= MAKE_SEMANTIC_VERSION(27, 0, 0)
-	if (obs_get_nix_platform() != OBS_NIX_PLATFORM_X11_GLX)
+static long get_desktop_count(Display *dpy)
+{
+	Atom type;
+	int format;
+	unsigned long count, remaining;
+	unsigned char *data;
+	int status = XGetWindowProperty(dpy, DefaultRootWindow(dpy), _NET_NUMBER_OF_DESKTOPS, 0, 1, False, XA_CARDINAL, &type, &format, &count, &remaining, &data);
+	if (status != Success)
 	{
-		blog(LOG_ERROR, "%s", "This plugin requires a GLX context");
-		goto not_glx_err;
+		return -1;
+	}
+	if (type != XA_CARDINAL || format != 32 || count != 1 || remaining != 0)
+	{
+		XFree(data);
+		return -1;
+	}
+	long ret = *(long *)data;
+	XFree(data);
+	return ret;
+}
+
+static unsigned long get_desktop_names(Display *dpy, char **names)
+{
+	if (_NET_DESKTOP_NAMES == None || UTF8_STRING == None)
+	{
+		return 0;
+	}
+	Atom type;
+	int format;
+	unsigned long count, remaining;
+	unsigned char *data;
+	int status = XGetWindowProperty(dpy, DefaultRootWindow(dpy), _NET_DESKTOP_NAMES, 0, (long)((unsigned long)-1 >> 1), False, UTF8_STRING, &type, &format, &count, &remaining, &data);
+	if (status != Success)
+	{
+		return 0;
 	}
+	if (type != UTF8_STRING || format != 8 || remaining != 0)
+	{
+		XFree(data);
+		return 0;
+	}
+	*names = (char *)data;
+	return count;
+}
+
+static void free_desktop_names(char *names)
+{
+	if (names)
+	{
+		XFree(names);
+	}
+}
+
+static void add_window_item(Display *dpy, obs_property_t *prop, Window window)
+{
+	Atom type;
+	int format;
+	unsigned long count, remaining;
+	unsigned char *data = NULL;
+	if (_NET_WM_NAME != None && UTF8_STRING != None &&
+		XGetWindowProperty(dpy, window, _NET_WM_NAME, 0, 1024, False, UTF8_STRING, &type, &format, &count, &remaining, &data) == Success &&
+		type == UTF8_STRING && format == 8 && count != 0)
+	{
+		obs_property_list_add_int(prop, (const char *)data, window);
+		XFree(data);
+		return;
+	}
+
+	if (data != NULL)
+	{
+		XFree(data);
+	}
+
+	char *name = NULL;
+	if (XFetchName(dpy, window, &name) && name != NULL)
+	{
+		obs_property_list_add_int(prop, name, window);
+		XFree(name);
+		return;
+	}
+
+	char text[32];
+	snprintf(text, sizeof(text), "Window 0x%lx", window);
+	obs_property_list_add_int(prop, text, window);
+}
+
+/* Lists the windows the window manager manages. */
+static void add_window_list(Display *dpy, obs_property_t *prop)
+{
+	Atom type;
+	int format;
+	unsigned long count, remaining;
+	unsigned char *data;
+	if (_NET_CLIENT_LIST == None || XGetWindowProperty(dpy, DefaultRootWindow(dpy), _NET_CLIENT_LIST, 0, 4096, False, XA_WINDOW, &type, &format, &count, &remaining, &data) != Success)
+	{
+		return;
+	}
+
+	if (type == XA_WINDOW && format == 32)
+	{
+		for (unsigned long i = 0; i < count; i++)
+		{
+			add_window_item(dpy, prop, ((Window *)data)[i]);
+		}
+	}
+
+	XFree(data);
+}
+#endif
+
+static bool run_benchmark(obs_properties_t *props, obs_property_t *property, void *p)
+{
+	bench_start();
+	return false;
+}
+
+static obs_properties_t *get_properties(void *p)
+{
+	data_t *data = p;
+
+	obs_properties_t *props = obs_properties_create();
+	if (props == NULL)
+	{
+		goto props_create_err;
+	}
+
+	NVFBC_GET_STATUS_PARAMS status_params = {
+		.dwVersion = NVFBC_GET_STATUS_PARAMS_VER};
+	bool status_valid = false;
+
+	int error = pthread_mutex_lock(&data->nvfbc.session_mutex);
+	if (error != 0)
+	{
+		goto create_context;
+	}
+
+	/* The capture thread may be waiting for a frame with the context bound, ask a handle of our own then. */
+	if (pthread_mutex_trylock(&data->nvfbc.grab_mutex) != 0)
+	{
+		goto grab_busy;
+	}
+
+	if (!enter_nvfbc_context(&data->nvfbc))
+	{
+		goto enter_ctx_failed;
+	}
+	status_valid = get_nvfbc_status(data->nvfbc.nvfbc_session, &status_params);
+	leave_nvfbc_context(&data->nvfbc);
+
+	error = pthread_mutex_unlock(&data->nvfbc.grab_mutex);
+	assert(error == 0);
+	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
+	assert(error == 0);
+
+	goto screen_list;
+
+enter_ctx_failed:;
+	error = pthread_mutex_unlock(&data->nvfbc.grab_mutex);
+	assert(error == 0);
+grab_busy:;
+	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
+	assert(error == 0);
+create_context:;
+	status_valid = get_nvfbc_status(-1, &status_params);
+
+screen_list:;
+	obs_property_t *prop = obs_properties_add_list(props, "screen", "Screen", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	if (prop == NULL)
+	{
+		goto screen_lst_alloc_err;
+	}
+
+	if (status_valid)
+	{
+		obs_property_list_add_int(prop, "Entire Desktop", -1);
+		obs_property_list_add_int(prop, "Stitched Outputs", SCREEN_STITCHED);
+#if !defined(_WIN32) || !_WIN32
+		obs_property_list_add_int(prop, "Window", SCREEN_WINDOW);
+		obs_property_list_add_int(prop, "Follow Cursor", SCREEN_CURSOR);
 #endif
+		for (int i = 0; i < status_params.dwOutputNum; i++)
+		{
+			obs_property_list_add_int(prop, status_params.outputs[i].name, status_params.outputs[i].dwId);
+		}
+	}
+
+#if !defined(_WIN32) || !_WIN32
+	prop = obs_properties_add_list(props, "window", "Window", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	add_window_list(data->x11.dpy, prop);
+	prop = obs_properties_add_int(props, "zoom_width", "Follow Cursor Width", 16, 16384, 1);
+	obs_property_set_long_description(prop, "Size of the box around the pointer that is captured in Follow Cursor mode.");
+	prop = obs_properties_add_int(props, "zoom_height", "Follow Cursor Height", 16, 16384, 1);
+	obs_property_set_long_description(prop, "Size of the box around the pointer that is captured in Follow Cursor mode.");
+#endif
+
+	prop = obs_properties_add_text(props, "stitch_layout", "Stitch Layout", OBS_TEXT_DEFAULT);
+	obs_property_set_long_description(prop, "Stitched Outputs only. Outputs and their position in the capture, like \"DP-0:0,0;HDMI-0:3840,0\". Leave empty to put all outputs next to each other.");
+
+	obs_properties_add_int(props, "fps", "FPS", 1, 999999, 1);
+	obs_properties_add_bool(props, "show_cursor", "Cursor");
+#if !defined(_WIN32) || !_WIN32
+	prop = obs_properties_add_bool(props, "cursor_overlay", "Draw Cursor As Overlay");
+	obs_property_set_long_description(prop, "Tracks the cursor through XFixes and draws it on top instead of letting NvFBC capture a new frame whenever it moves.");
+#endif
+	obs_properties_add_bool(props, "push_model", "Use Push Model");
+	prop = obs_properties_add_bool(props, "auto_model", "Choose Push/Pull Model Automatically");
+	obs_property_set_long_description(prop, "Measures the frame age and dropped frames of both models for a few seconds each and keeps the better one. Keeps \"Use Push Model\" if the desktop was too still to tell. Turns phase lock off.");
+	obs_properties_add_bool(props, "direct_capture", "Use Direct Capture");
+	obs_properties_add_bool(props, "adaptive_resolution", "Lower Resolution When Copies Run Long");
+	prop = obs_properties_add_bool(props, "mipmaps", "Mipmaps When Drawn Small");
+	obs_property_set_long_description(prop, "Builds mipmaps for new frames while the source is drawn at less than half its size somewhere, for example in the multiview. "
+		"The size is estimated against the base canvas. In source projectors, nested scenes and under filters the estimate is off by the ratio between their size and the canvas, so mipmaps may be built when not needed or missing when they are.");
+	prop = obs_properties_add_bool(props, "phase_lock", "Phase-Lock To OBS Frames");
+	obs_property_set_long_description(prop, "Pull model only, and only at OBS frame rates with a whole-millisecond interval like 50 or 100 FPS, "
+		"because NvFBC samples in whole milliseconds. Samples at the OBS frame rate and aligns NvFBC's sampling with the OBS frame tick. "
+		"Each correction recreates the capture session, which skips a frame and forces a refresh; they are at least 5 seconds apart.");
+	obs_property_set_enabled(prop, is_lockable_interval(get_obs_frame_interval_ns()));
+	prop = obs_properties_add_bool(props, "threaded", "Capture On Separate Thread");
+	obs_property_set_long_description(prop, "Grabs on a thread of its own so that several sources capture in parallel instead of one after another on the OBS graphics thread.");
+	prop = obs_properties_add_bool(props, "low_latency", "Low-Latency Capture Thread");
+	obs_property_set_long_description(prop, "Grabs on a separate thread and waits for a new frame until shortly before the next OBS frame is due.");
+#if !defined(_WIN32) || !_WIN32
+	prop = obs_properties_add_list(props, "thread_priority", "Capture Thread Priority", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, "Normal", THREAD_PRIORITY_NORMAL);
+	obs_property_list_add_int(prop, "High (Nice)", THREAD_PRIORITY_HIGH);
+	obs_property_list_add_int(prop, "Realtime (SCHED_FIFO)", THREAD_PRIORITY_FIFO);
+	obs_property_list_add_int(prop, "Realtime (SCHED_RR)", THREAD_PRIORITY_RR);
+	obs_property_set_long_description(prop, "Realtime scheduling falls back to a raised nice value if the process is not allowed to use it.");
+	prop = obs_properties_add_text(props, "cpu_affinity", "Capture Thread CPUs", OBS_TEXT_DEFAULT);
+	obs_property_set_long_description(prop, "CPU list like \"0-3,8\". Leave empty to run on any CPU.");
+	prop = obs_properties_add_int(props, "timer_slack_us", "Capture Thread Timer Slack (us)", 0, 50000, 1);
+	obs_property_set_long_description(prop, "0 keeps the default timer slack.");
 #endif
 
-	data_t *data = bzalloc(sizeof(data_t));
-	if (data == NULL)
-	{
-		blog(LOG_ERROR, "%s", "Out of memory");
-		goto alloc_err;
-	}
+	prop = obs_properties_add_list(props, "capture_policy", "Capture Policy", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, "Always Capture While Visible", CAPTURE_POLICY_ALWAYS);
+	obs_property_list_add_int(prop, "Full Rate On Program, Reduced Elsewhere", CAPTURE_POLICY_REDUCED);
+	obs_property_list_add_int(prop, "Only Capture On Program", CAPTURE_POLICY_PROGRAM);
+	prop = obs_properties_add_int(props, "reduced_divider", "Reduced Rate Divider", 2, 60, 1);
+	obs_property_set_long_description(prop, "With reduced rate, only every n-th OBS frame is captured while the source is visible but not on program.");
 
-	data->obs.source = source;
-	copy_settings(&data->settings, settings);
-	data->nvfbc.nvfbc_session = -1;
 #if !defined(_WIN32) || !_WIN32
-	data->x11.dpy = dpy;
+	prop = obs_properties_add_bool(props, "latency_probe", "Measure Latency With A Marker");
+	obs_property_set_long_description(prop, "Flashes a small square in the top-left corner of the captured area and logs how long it takes until it is grabbed and drawn. The square shows up in the capture.");
 #endif
 
-	int error = pthread_mutex_init(&data->nvfbc.session_mutex, NULL);
-	if (error != 0)
-	{
-		blog(LOG_ERROR, "Mutex initialization error: %s", strerror(error));
-		goto sess_mutex_err;
-	}
+	obs_properties_add_int(props, "crop_left", "Crop Left", 0, 16384, 1);
+	obs_properties_add_int(props, "crop_top", "Crop Top", 0, 16384, 1);
+	obs_properties_add_int(props, "crop_right", "Crop Right", 0, 16384, 1);
+	obs_properties_add_int(props, "crop_bottom", "Crop Bottom", 0, 16384, 1);
+	prop = obs_properties_add_text(props, "masks", "Privacy Masks", OBS_TEXT_DEFAULT);
+	obs_property_set_long_description(prop, "Up to 4 rectangles in cropped pixels like \"0,0,400,300;800,0,200,100,12\". A fifth number blurs the rectangle with that radius instead of blacking it out.");
+	prop = obs_properties_add_text(props, "color_matrix", "Colour Matrix", OBS_TEXT_DEFAULT);
+	obs_property_set_long_description(prop, "12 numbers, one row of red, green, blue and offset for each of the red, green and blue outputs. Leave empty to keep the colours.");
 
-	error = pthread_mutex_init(&data->tex.texture_mutex, NULL);
-	if (error != 0)
-	{
-		blog(LOG_ERROR, "Mutex initialization error: %s", strerror(error));
-		goto tex_mutex_err;
-	}
+	obs_properties_add_button(props, "benchmark", "Benchmark All NvFBC Sources", run_benchmark);
 
-	if (!create_nvfbc_session(&data->nvfbc))
+#if !defined(_WIN32) || !_WIN32
+	prop = obs_properties_add_list(props, "desktop", "Desktop", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	if (prop == NULL)
 	{
-		goto nvfbc_err;
+		goto screen_lst_alloc_err;
 	}
-	leave_nvfbc_context(&data->nvfbc);
 
-	return data;
+	obs_property_list_add_int(prop, "All Desktops", -1);
+	Display *dpy = data->x11.dpy;
+	long desktop_count;
+	if (_NET_CURRENT_DESKTOP != None && _NET_NUMBER_OF_DESKTOPS != None && (desktop_count = get_desktop_count(dpy)) > 0 && get_current_desktop(dpy) >= 0)
+	{
+		char *desktop_names = NULL;
+		long desktop_names_len = get_desktop_names(dpy, &desktop_names);
+		char *p = desktop_names;
 
-nvfbc_err:;
-	pthread_mutex_destroy(&data->tex.texture_mutex);
-tex_mutex_err:;
-	pthread_mutex_destroy(&data->nvfbc.session_mutex);
-sess_mutex_err:;
-	bfree(data);
-alloc_err:;
-#if !defined(_WIN32) || !_WIN32
-#if LIBOBS_API_VER >= MAKE_SEMANTIC_VERSION(27, 0, 0)
-not_glx_err:;
-#endif
-#endif
-not_opengl_err:;
-	return NULL;
-}
+		for (int i = 0; i < desktop_count; i++)
+		{
+			size_t remaining_len;
+			if (p)
+			{
+				remaining_len = desktop_names_len - (p - desktop_names);
+				if (!remaining_len)
+				{
+					p = NULL;
+				}
+			}
 
-static void destroy(void *p)
-{
-	data_t *data = p;
+			char text[64];
+			if (p && *p)
+			{
+				snprintf(text, sizeof(text), "Desktop %i (%.*s)", i + 1, (int)remaining_len, p);
+			}
+			else
+			{
+				snprintf(text, sizeof(text), "Desktop %i", i + 1);
+			}
+			obs_property_list_add_int(prop, text, i);
 
-	pthread_mutex_lock(&data->tex.texture_mutex);
+			if (p)
+			{
+				p = memchr(p, '\0', remaining_len) + 1;
+			}
+		}
 
-	if (data->tex.texture != NULL)
+		free_desktop_names(desktop_names);
+	}
+	else
 	{
-		gs_texture_destroy(data->tex.texture);
+		obs_property_set_enabled(prop, false);
 	}
+#endif
 
-	pthread_mutex_lock(&data->nvfbc.session_mutex);
+	return props;
 
-	if (data->nvfbc.nvfbc_session != -1)
+screen_lst_alloc_err:;
+	obs_properties_destroy(props);
+props_create_err:;
+	return NULL;
+}
+
+/* Must be called with the session mutex held. */
+static void stop_capture_session(data_t *data)
+{
+	if (enter_nvfbc_context(&data->nvfbc))
 	{
-		while (!enter_nvfbc_context(&data->nvfbc))
-			;
 		destroy_capture_session(&data->nvfbc);
-		destroy_nvfbc_session(&data->nvfbc);
+		leave_nvfbc_context(&data->nvfbc);
 	}
 
-	pthread_mutex_destroy(&data->tex.texture_mutex);
-	pthread_mutex_destroy(&data->nvfbc.session_mutex);
-
-	bfree(data);
+	data->sched.rearm_ns = 0;
+	/* A new session may count its timestamps from somewhere else. */
+	data->sched.clock.valid = false;
+	sched_report(data);
+	direct_report(data);
 }
 
-static void render(void *p, gs_effect_t *effect)
+/* Creates or destroys the capture session to match where the source is visible and the
+	capture policy. New settings, if given, are applied to a fresh session. */
+static void apply_capture_state(data_t *data, obs_data_t *settings)
 {
-	data_t *data = p;
+	stop_capture_thread(data);
+#if !defined(_WIN32) || !_WIN32
+	stop_probe_thread(data);
+#endif
 
-	if (!update_texture(data))
+	int error = pthread_mutex_lock(&data->nvfbc.session_mutex);
+	if (error != 0)
 	{
-		goto tex_upd_err;
+		blog(LOG_ERROR, "Mutex lock error: %s", strerror(error));
+		return;
 	}
 
-	if (!data->tex.texture)
+	if (settings != NULL)
 	{
-		goto no_texture;
-	}
+		stop_capture_session(data);
+		copy_settings(&data->settings, settings);
+		direct_reset(&data->direct);
 
-	effect = obs_get_base_effect(OBS_EFFECT_OPAQUE);
-	gs_blend_state_push();
-	gs_reset_blend_state();
+		pthread_mutex_lock(&data->tex.texture_mutex);
+		scale_reset(&data->scale);
+		pthread_mutex_unlock(&data->tex.texture_mutex);
 
-	int error = pthread_mutex_lock(&data->tex.texture_mutex);
-	if (error != 0)
-	{
-		blog(LOG_ERROR, "Mutex lock error: %s", strerror(error));
-		goto tex_lock_err;
+#if !defined(_WIN32) || !_WIN32
+		close_window_tracker(&data->window);
+		data->window.lost = None;
+		data->nvfbc.follow_box = (NVFBC_BOX){0};
+#endif
 	}
 
-	gs_eparam_t *image = gs_effect_get_param_by_name(effect, "image");
-	if (image == NULL)
+	bool want_session = get_capture_state(data) != CAPTURE_PAUSED;
+	if (want_session && !data->nvfbc.has_capture_session)
 	{
-		blog(LOG_ERROR, "Effect image parameter not found");
-		goto no_image;
+		start_capture_session(data);
+	}
+	else if (!want_session && data->nvfbc.has_capture_session)
+	{
+		stop_capture_session(data);
 	}
-	gs_effect_set_texture(image, data->tex.texture);
 
-	while (gs_effect_loop(effect, "Draw"))
+	bool has_capture_session = data->nvfbc.has_capture_session;
+
+#if !defined(_WIN32) || !_WIN32
+	if (data->settings.latency_probe && has_capture_session)
 	{
-		gs_draw_sprite(data->tex.texture, 0, 0, 0);
+		start_probe_thread(data);
 	}
+#endif
 
-	error = pthread_mutex_unlock(&data->tex.texture_mutex);
+	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
 	assert(error == 0);
 
-	gs_blend_state_pop();
+	if (use_capture_thread(&data->settings) && has_capture_session)
+	{
+		start_capture_thread(data);
+	}
+}
 
-	return;
+static void show(void *p)
+{
+	data_t *data = p;
 
-no_image:;
-	error = pthread_mutex_unlock(&data->tex.texture_mutex);
-	assert(error == 0);
-tex_lock_err:;
-	gs_blend_state_pop();
-no_texture:;
-tex_upd_err:;
-	return;
+	data->obs.showing = true;
+	apply_capture_state(data, NULL);
 }
 
-uint32_t get_width(void *p)
+static void hide(void *p)
 {
 	data_t *data = p;
 
-	return data->tex.width;
+	data->obs.showing = false;
+	apply_capture_state(data, NULL);
 }
 
-uint32_t get_height(void *p)
+static void activate(void *p)
 {
 	data_t *data = p;
 
-	return data->tex.height;
+	data->obs.active = true;
+	apply_capture_state(data, NULL);
 }
 
-static void get_defaults(obs_data_t *settings)
+static void deactivate(void *p)
 {
-	NVFBC_GET_STATUS_PARAMS status_params = {
-		.dwVersion = NVFBC_GET_STATUS_PARAMS_VER};
+	data_t *data = p;
 
-	if (get_nvfbc_status(-1, &status_params))
-	{
-		obs_data_set_default_int(settings, "screen", status_params.outputs[0].dwId);
-	}
+	data->obs.active = false;
+	apply_capture_state(data, NULL);
+}
 
-	obs_data_set_default_int(settings, "fps", 60);
-	obs_data_set_default_bool(settings, "show_cursor", true);
-	obs_data_set_default_bool(settings, "push_model", true);
-	obs_data_set_default_bool(settings, "direct_capture", false);
-#if !defined(_WIN32) || !_WIN32
-	obs_data_set_default_int(settings, "desktop", -1);
-#endif
+static void update(void *p, obs_data_t *settings)
+{
+	data_t *data = p;
+
+	apply_capture_state(data, settings);
 }
 
-#if !defined(_WIN32) || !_WIN32
-static long get_desktop_count(Display *dpy)
+struct obs_source_info nvfbc_source = {
+	.id = "nvfbc-source",
+	.type = OBS_SOURCE_TYPE_INPUT,
+	.get_name = get_name,
+	.output_flags = OBS_SOURCE_VIDEO | OBS_SOURCE_CUSTOM_DRAW | OBS_SOURCE_DO_NOT_DUPLICATE,
+
+	.create = create,
+	.destroy = destroy,
+	.video_tick = video_tick,
+	.video_render = render,
+	.get_width = get_width,
+	.get_height = get_height,
+
+	.get_defaults = get_defaults,
+	.get_properties = get_properties,
+	.show = show,
+	.hide = hide,
+	.activate = activate,
+	.deactivate = deactivate,
+	.update = update,
+};
+
+/* Draws part of another NvFBC source's texture, so any number of regions share one grab and one copy. */
+typedef struct
 {
-	Atom type;
-	int format;
-	unsigned long count, remaining;
-	unsigned char *data;
-	int status = XGetWindowProperty(dpy, DefaultRootWindow(dpy), _NET_NUMBER_OF_DESKTOPS, 0, 1, False, XA_CARDINAL, &type, &format, &count, &remaining, &data);
-	if (status != Success)
+	obs_source_t *source;
+	char *parent_name;
+	/* Guards the parent, which is also looked at from outside the graphics thread. */
+	pthread_mutex_t parent_mutex;
+	obs_weak_source_t *parent;
+	/* Set when a source was created or renamed, the next tick looks for a missing parent again. */
+	volatile bool resolve_pending;
+	uint32_t x, y, width, height;
+	bool showing;
+	bool active;
+} region_t;
+
+static const char *region_get_name(void *type_data)
+{
+	return "NvFBC Region";
+}
+
+/* Returns a reference on the parent, NULL if there is none or it is gone. */
+static obs_source_t *region_ref_parent(region_t *region)
+{
+	pthread_mutex_lock(&region->parent_mutex);
+	obs_source_t *parent = region->parent != NULL ? obs_weak_source_get_source(region->parent) : NULL;
+	pthread_mutex_unlock(&region->parent_mutex);
+
+	return parent;
+}
+
+static void region_release_parent(region_t *region)
+{
+	pthread_mutex_lock(&region->parent_mutex);
+	obs_weak_source_t *weak_parent = region->parent;
+	region->parent = NULL;
+	pthread_mutex_unlock(&region->parent_mutex);
+
+	if (weak_parent == NULL)
 	{
-		return -1;
+		return;
 	}
-	if (type != XA_CARDINAL || format != 32 || count != 1 || remaining != 0)
+
+	obs_source_t *parent = obs_weak_source_get_source(weak_parent);
+	if (parent != NULL)
 	{
-		XFree(data);
-		return -1;
+		if (region->active)
+		{
+			obs_source_dec_active(parent);
+		}
+		if (region->showing)
+		{
+			obs_source_dec_showing(parent);
+		}
+		obs_source_release(parent);
 	}
-	long ret = *(long *)data;
-	XFree(data);
-	return ret;
+
+	obs_weak_source_release(weak_parent);
 }
 
-static unsigned long get_desktop_names(Display *dpy, char **names)
+/* Must be called from the graphics thread. The parent may not exist yet while a scene collection
+	loads, so this is retried whenever a source is created or renamed. Showing and activating the
+	region shows and activates the parent, its capture policy stays in charge. */
+static void region_resolve_parent(region_t *region)
 {
-	if (_NET_DESKTOP_NAMES == None || UTF8_STRING == None)
+	if (region->parent != NULL || region->parent_name == NULL || *region->parent_name == '\0')
 	{
-		return 0;
+		return;
 	}
-	Atom type;
-	int format;
-	unsigned long count, remaining;
-	unsigned char *data;
-	int status = XGetWindowProperty(dpy, DefaultRootWindow(dpy), _NET_DESKTOP_NAMES, 0, (long)((unsigned long)-1 >> 1), False, UTF8_STRING, &type, &format, &count, &remaining, &data);
-	if (status != Success)
+
+	obs_source_t *parent = obs_get_source_by_name(region->parent_name);
+	if (parent == NULL)
+	{
+		return;
+	}
+
+	if (strcmp(obs_source_get_id(parent), nvfbc_source.id) == 0)
+	{
+		pthread_mutex_lock(&region->parent_mutex);
+		region->parent = obs_source_get_weak_source(parent);
+		pthread_mutex_unlock(&region->parent_mutex);
+		if (region->showing)
+		{
+			obs_source_inc_showing(parent);
+		}
+		if (region->active)
+		{
+			obs_source_inc_active(parent);
+		}
+	}
+
+	obs_source_release(parent);
+}
+
+static data_t *region_get_parent(region_t *region, obs_source_t **parent)
+{
+	*parent = region_ref_parent(region);
+	if (*parent == NULL)
 	{
-		return 0;
+		return NULL;
 	}
-	if (type != UTF8_STRING || format != 8 || remaining != 0)
+
+	data_t *data = coordinator_find(*parent);
+	if (data == NULL)
 	{
-		XFree(data);
-		return 0;
+		obs_source_release(*parent);
 	}
-	*names = (char *)data;
-	return count;
+
+	return data;
 }
 
-static void free_desktop_names(char *names)
+/* Clips the region to the parent's capture. A width or height of 0 extends the region to the edge. */
+static bool region_get_rect(const region_t *region, const data_texture_t *tex, uint32_t *cx, uint32_t *cy)
 {
-	if (names)
+	if (region->x >= tex->display_width || region->y >= tex->display_height)
 	{
-		XFree(names);
+		return false;
 	}
+
+	uint32_t max_cx = tex->display_width - region->x;
+	uint32_t max_cy = tex->display_height - region->y;
+	*cx = region->width == 0 || region->width > max_cx ? max_cx : region->width;
+	*cy = region->height == 0 || region->height > max_cy ? max_cy : region->height;
+
+	return true;
 }
-#endif
 
-static obs_properties_t *get_properties(void *p)
+static void region_update(void *p, obs_data_t *settings)
 {
-	data_t *data = p;
+	region_t *region = p;
 
-	obs_properties_t *props = obs_properties_create();
-	if (props == NULL)
+	const char *parent_name = obs_data_get_string(settings, "parent");
+	if (region->parent_name == NULL || strcmp(region->parent_name, parent_name) != 0)
 	{
-		goto props_create_err;
+		region_release_parent(region);
+		bfree(region->parent_name);
+		region->parent_name = bstrdup(parent_name);
+		region_resolve_parent(region);
 	}
 
-	NVFBC_GET_STATUS_PARAMS status_params = {
-		.dwVersion = NVFBC_GET_STATUS_PARAMS_VER};
-	bool status_valid = false;
+	region->x = obs_data_get_int(settings, "x");
+	region->y = obs_data_get_int(settings, "y");
+	region->width = obs_data_get_int(settings, "width");
+	region->height = obs_data_get_int(settings, "height");
+}
 
-	int error = pthread_mutex_lock(&data->nvfbc.session_mutex);
-	if (error != 0)
+static void region_source_signal(void *p, calldata_t *cd)
+{
+	region_t *region = p;
+
+	os_atomic_set_bool(&region->resolve_pending, true);
+}
+
+static void *region_create(obs_data_t *settings, obs_source_t *source)
+{
+	region_t *region = bzalloc(sizeof(region_t));
+	if (region == NULL)
 	{
-		goto create_context;
+		blog(LOG_ERROR, "%s", "Out of memory");
+		goto alloc_err;
 	}
 
-	if (!enter_nvfbc_context(&data->nvfbc))
+	int error = pthread_mutex_init(&region->parent_mutex, NULL);
+	if (error != 0)
 	{
-		goto enter_ctx_failed;
+		blog(LOG_ERROR, "Mutex initialization error: %s", strerror(error));
+		goto parent_mutex_err;
 	}
-	status_valid = get_nvfbc_status(data->nvfbc.nvfbc_session, &status_params);
-	leave_nvfbc_context(&data->nvfbc);
 
-	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
-	assert(error == 0);
+	region->source = source;
+	region_update(region, settings);
 
-	goto screen_list;
+	signal_handler_t *signals = obs_get_signal_handler();
+	signal_handler_connect(signals, "source_create", region_source_signal, region);
+	signal_handler_connect(signals, "source_rename", region_source_signal, region);
 
-enter_ctx_failed:;
-	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
-	assert(error == 0);
-create_context:;
-	status_valid = get_nvfbc_status(-1, &status_params);
+	return region;
 
-screen_list:;
-	obs_property_t *prop = obs_properties_add_list(props, "screen", "Screen", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
-	if (prop == NULL)
-	{
-		goto screen_lst_alloc_err;
-	}
+parent_mutex_err:;
+	bfree(region);
+alloc_err:;
+	return NULL;
+}
 
-	if (status_valid)
+static void region_destroy(void *p)
+{
+	region_t *region = p;
+
+	signal_handler_t *signals = obs_get_signal_handler();
+	signal_handler_disconnect(signals, "source_create", region_source_signal, region);
+	signal_handler_disconnect(signals, "source_rename", region_source_signal, region);
+
+	region_release_parent(region);
+	pthread_mutex_destroy(&region->parent_mutex);
+	bfree(region->parent_name);
+	bfree(region);
+}
+
+static void region_video_tick(void *p, float seconds)
+{
+	region_t *region = p;
+
+	/* The parent was removed, a source created with its name later is picked up instead. */
+	if (region->parent != NULL)
 	{
-		obs_property_list_add_int(prop, "Entire Desktop", -1);
-		for (int i = 0; i < status_params.dwOutputNum; i++)
+		obs_source_t *parent = region_ref_parent(region);
+		if (parent == NULL)
 		{
-			obs_property_list_add_int(prop, status_params.outputs[i].name, status_params.outputs[i].dwId);
+			region_release_parent(region);
+		}
+		else
+		{
+			obs_source_release(parent);
 		}
 	}
 
-	obs_properties_add_int(props, "fps", "FPS", 1, 999999, 1);
-	obs_properties_add_bool(props, "show_cursor", "Cursor");
-	obs_properties_add_bool(props, "push_model", "Use Push Model");
-	obs_properties_add_bool(props, "direct_capture", "Use Direct Capture");
+	if (os_atomic_load_bool(&region->resolve_pending))
+	{
+		os_atomic_set_bool(&region->resolve_pending, false);
+		region_resolve_parent(region);
+	}
+}
 
-#if !defined(_WIN32) || !_WIN32
-	prop = obs_properties_add_list(props, "desktop", "Desktop", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
-	if (prop == NULL)
+static void region_render(void *p, gs_effect_t *effect)
+{
+	region_t *region = p;
+
+	obs_source_t *parent;
+	data_t *data = region_get_parent(region, &parent);
+	if (data == NULL)
 	{
-		goto screen_lst_alloc_err;
+		goto no_parent;
 	}
 
-	obs_property_list_add_int(prop, "All Desktops", -1);
-	Display *dpy = data->x11.dpy;
-	long desktop_count;
-	if (_NET_CURRENT_DESKTOP != None && _NET_NUMBER_OF_DESKTOPS != None && (desktop_count = get_desktop_count(dpy)) > 0 && get_current_desktop(dpy) >= 0)
+	int error = pthread_mutex_lock(&data->tex.texture_mutex);
+	if (error != 0)
 	{
-		char *desktop_names = NULL;
-		long desktop_names_len = get_desktop_names(dpy, &desktop_names);
-		char *p = desktop_names;
+		blog(LOG_ERROR, "Mutex lock error: %s", strerror(error));
+		goto tex_lock_err;
+	}
 
-		for (int i = 0; i < desktop_count; i++)
-		{
-			size_t remaining_len;
-			if (p)
-			{
-				remaining_len = desktop_names_len - (p - desktop_names);
-				if (!remaining_len)
-				{
-					p = NULL;
-				}
-			}
+	uint32_t cx, cy;
+	if (data->tex.texture == NULL || !region_get_rect(region, &data->tex, &cx, &cy))
+	{
+		goto no_region;
+	}
 
-			char text[64];
-			if (p && *p)
-			{
-				snprintf(text, sizeof(text), "Desktop %i (%.*s)", i + 1, (int)remaining_len, p);
-			}
-			else
-			{
-				snprintf(text, sizeof(text), "Desktop %i", i + 1);
-			}
-			obs_property_list_add_int(prop, text, i);
+	effect = obs_get_base_effect(OBS_EFFECT_OPAQUE);
+	gs_eparam_t *image = gs_effect_get_param_by_name(effect, "image");
+	if (image == NULL)
+	{
+		blog(LOG_ERROR, "Effect image parameter not found");
+		goto no_region;
+	}
 
-			if (p)
-			{
-				p = memchr(p, '\0', remaining_len) + 1;
-			}
-		}
+	/* The parent may capture at a lower resolution than it is shown at. */
+	float scale_x = (float)data->tex.width / data->tex.display_width;
+	float scale_y = (float)data->tex.height / data->tex.display_height;
 
-		free_desktop_names(desktop_names);
+	if (data->settings.mipmaps)
+	{
+		note_draw_scale(&data->tex);
 	}
-	else
+
+	gs_blend_state_push();
+	gs_reset_blend_state();
+	gs_matrix_push();
+	gs_matrix_scale3f(1.0f / scale_x, 1.0f / scale_y, 1.0f);
+	gs_effect_set_texture(image, data->tex.texture);
+
+	while (gs_effect_loop(effect, "Draw"))
 	{
-		obs_property_set_enabled(prop, false);
+		gs_draw_sprite_subregion(data->tex.texture, 0, (data->tex.view.x + region->x) * scale_x, (data->tex.view.y + region->y) * scale_y, cx * scale_x, cy * scale_y);
 	}
-#endif
 
-	return props;
+	gs_matrix_pop();
+	gs_blend_state_pop();
 
-screen_lst_alloc_err:;
-	obs_properties_destroy(props);
-props_create_err:;
-	return NULL;
+no_region:;
+	error = pthread_mutex_unlock(&data->tex.texture_mutex);
+	assert(error == 0);
+tex_lock_err:;
+	obs_source_release(parent);
+no_parent:;
+	return;
 }
 
-static void show(void *p)
+static uint32_t region_get_size(region_t *region, bool height)
 {
-	data_t *data = p;
-
-	int error = pthread_mutex_lock(&data->nvfbc.session_mutex);
-	if (error != 0)
+	obs_source_t *parent;
+	data_t *data = region_get_parent(region, &parent);
+	if (data == NULL)
 	{
-		blog(LOG_ERROR, "Mutex lock error: %s", strerror(error));
-		return;
+		return height ? region->height : region->width;
 	}
 
-	if (enter_nvfbc_context(&data->nvfbc))
-	{
-		create_capture_session(&data->nvfbc, &data->settings);
-		leave_nvfbc_context(&data->nvfbc);
-	}
+	uint32_t cx = 0, cy = 0;
+	pthread_mutex_lock(&data->tex.texture_mutex);
+	region_get_rect(region, &data->tex, &cx, &cy);
+	pthread_mutex_unlock(&data->tex.texture_mutex);
+	obs_source_release(parent);
 
-	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
-	assert(error == 0);
+	return height ? cy : cx;
 }
 
-static void hide(void *p)
+static uint32_t region_get_width(void *p)
 {
-	data_t *data = p;
+	return region_get_size(p, false);
+}
 
-	int error = pthread_mutex_lock(&data->nvfbc.session_mutex);
-	if (error != 0)
-	{
-		blog(LOG_ERROR, "Mutex lock error: %s", strerror(error));
-		return;
-	}
+static uint32_t region_get_height(void *p)
+{
+	return region_get_size(p, true);
+}
 
-	if (enter_nvfbc_context(&data->nvfbc))
+static void region_get_defaults(obs_data_t *settings)
+{
+	obs_data_set_default_string(settings, "parent", "");
+	obs_data_set_default_int(settings, "x", 0);
+	obs_data_set_default_int(settings, "y", 0);
+	obs_data_set_default_int(settings, "width", 0);
+	obs_data_set_default_int(settings, "height", 0);
+}
+
+static bool region_add_parent(void *param, obs_source_t *source)
+{
+	if (strcmp(obs_source_get_id(source), nvfbc_source.id) == 0)
 	{
-		destroy_capture_session(&data->nvfbc);
-		leave_nvfbc_context(&data->nvfbc);
+		const char *name = obs_source_get_name(source);
+		obs_property_list_add_string(param, name, name);
 	}
 
-	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
-	assert(error == 0);
+	return true;
 }
 
-static void update(void *p, obs_data_t *settings)
+static obs_properties_t *region_get_properties(void *p)
 {
-	data_t *data = p;
-
-	int error = pthread_mutex_lock(&data->nvfbc.session_mutex);
-	if (error != 0)
+	obs_properties_t *props = obs_properties_create();
+	if (props == NULL)
 	{
-		blog(LOG_ERROR, "Mutex lock error: %s", strerror(error));
-		return;
+		return NULL;
 	}
 
-	if (enter_nvfbc_context(&data->nvfbc))
+	obs_property_t *prop = obs_properties_add_list(props, "parent", "NvFBC Source", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+	obs_enum_sources(region_add_parent, prop);
+
+	obs_properties_add_int(props, "x", "X", 0, 65535, 1);
+	obs_properties_add_int(props, "y", "Y", 0, 65535, 1);
+	prop = obs_properties_add_int(props, "width", "Width", 0, 65535, 1);
+	obs_property_set_long_description(prop, "0 extends the region to the right edge of the capture.");
+	prop = obs_properties_add_int(props, "height", "Height", 0, 65535, 1);
+	obs_property_set_long_description(prop, "0 extends the region to the bottom edge of the capture.");
+
+	return props;
+}
+
+static void region_set_parent_state(region_t *region, void (*set_state)(obs_source_t *))
+{
+	obs_source_t *parent = region_ref_parent(region);
+	if (parent != NULL)
 	{
-		destroy_capture_session(&data->nvfbc);
-		copy_settings(&data->settings, settings);
-		create_capture_session(&data->nvfbc, &data->settings);
-		leave_nvfbc_context(&data->nvfbc);
+		set_state(parent);
+		obs_source_release(parent);
 	}
+}
 
-	error = pthread_mutex_unlock(&data->nvfbc.session_mutex);
-	assert(error == 0);
+static void region_show(void *p)
+{
+	region_t *region = p;
+
+	region->showing = true;
+	region_set_parent_state(region, obs_source_inc_showing);
 }
 
-struct obs_source_info nvfbc_source = {
-	.id = "nvfbc-source",
-	.type = OBS_SOURCE_TYPE_INPUT,
-	.get_name = get_name,
-	.output_flags = OBS_SOURCE_VIDEO | OBS_SOURCE_CUSTOM_DRAW | OBS_SOURCE_DO_NOT_DUPLICATE,
+static void region_hide(void *p)
+{
+	region_t *region = p;
 
-	.create = create,
-	.destroy = destroy,
-	.video_render = render,
-	.get_width = get_width,
-	.get_height = get_height,
+	region->showing = false;
+	region_set_parent_state(region, obs_source_dec_showing);
+}
 
-	.get_defaults = get_defaults,
-	.get_properties = get_properties,
-	.show = show,
-	.hide = hide,
-	.update = update,
+static void region_activate(void *p)
+{
+	region_t *region = p;
+
+	region->active = true;
+	region_set_parent_state(region, obs_source_inc_active);
+}
+
+static void region_deactivate(void *p)
+{
+	region_t *region = p;
+
+	region->active = false;
+	region_set_parent_state(region, obs_source_dec_active);
+}
+
+struct obs_source_info nvfbc_region_source = {
+	.id = "nvfbc-region-source",
+	.type = OBS_SOURCE_TYPE_INPUT,
+	.get_name = region_get_name,
+	.output_flags = OBS_SOURCE_VIDEO | OBS_SOURCE_CUSTOM_DRAW,
+
+	.create = region_create,
+	.destroy = region_destroy,
+	.video_tick = region_video_tick,
+	.video_render = region_render,
+	.get_width = region_get_width,
+	.get_height = region_get_height,
+
+	.get_defaults = region_get_defaults,
+	.get_properties = region_get_properties,
+	.show = region_show,
+	.hide = region_hide,
+	.activate = region_activate,
+	.deactivate = region_deactivate,
+	.update = region_update,
 };
 
 static bool check_ext_in_string(const char *str, const char *name)
@@ -1210,6 +6135,8 @@ bool obs_module_load(void)
 	_NET_NUMBER_OF_DESKTOPS = XInternAtom(glXGetCurrentDisplay(), "_NET_NUMBER_OF_DESKTOPS", False);
 	_NET_DESKTOP_NAMES = XInternAtom(glXGetCurrentDisplay(), "_NET_DESKTOP_NAMES", False);
 	UTF8_STRING = XInternAtom(glXGetCurrentDisplay(), "UTF8_STRING", False);
+	_NET_CLIENT_LIST = XInternAtom(glXGetCurrentDisplay(), "_NET_CLIENT_LIST", False);
+	_NET_WM_NAME = XInternAtom(glXGetCurrentDisplay(), "_NET_WM_NAME", False);
 #endif
 
 #if _WIN32
@@ -1238,9 +6165,28 @@ bool obs_module_load(void)
 	}
 #endif
 
+	char *effect_error = NULL;
+	post_effect = gs_effect_create(post_effect_string, "nvfbc-post-process.effect", &effect_error);
+	if (post_effect == NULL)
+	{
+		blog(LOG_WARNING, "NvFBC: Post-processing not available: %s", effect_error != NULL ? effect_error : "unknown error");
+		bfree(effect_error);
+	}
+
+	GLint texture_size = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &texture_size);
+	max_texture_size = texture_size > 0 ? (uint32_t)texture_size : 0;
+
 	obs_leave_graphics();
 
+	const char *trace = getenv("OBS_NVFBC_TRACE");
+	if (trace != NULL && *trace != '\0')
+	{
+		trace_start(trace);
+	}
+
 	obs_register_source(&nvfbc_source);
+	obs_register_source(&nvfbc_region_source);
 
 	return true;
 
@@ -1257,6 +6203,16 @@ error:;
 
 void obs_module_unload(void)
 {
+	trace_stop();
+
+	if (post_effect != NULL)
+	{
+		obs_enter_graphics();
+		gs_effect_destroy(post_effect);
+		obs_leave_graphics();
+		post_effect = NULL;
+	}
+
 	if (nvfbc_lib != NULL)
 	{
 		os_dlclose(nvfbc_lib);